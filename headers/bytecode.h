@@ -0,0 +1,24 @@
+#ifndef potato_bytecode_h
+#define potato_bytecode_h
+
+#include "chunk.h"
+
+// Compiled chunks can be cached in .potc images, laid out so they can be
+// mapped read-only and run in place. The format is tied to the opcode
+// numbering, so bump the version whenever OpCode changes.
+#define BYTECODE_VERSION 3
+
+uint64_t hashSource(const char* source, size_t length);
+// Serializes chunk, recording which source and optimization level it was
+// compiled from. Returns false if the file cannot be written.
+bool writeBytecode(Chunk* chunk, uint64_t sourceHash, const char* path);
+// True when bytes were written by this version from the same source at
+// the current optimization level, and pass every check readBytecode() makes.
+bool bytecodeFresh(const uint8_t* bytes, size_t size, uint64_t sourceHash);
+// Rebuilds the chunk, interning its strings. Where it can, the chunk runs
+// its code from bytes directly, so bytes must outlive it. Returns false on
+// a file this version cannot read. The caller must keep chunk's constants
+// marked.
+bool readBytecode(const uint8_t* bytes, size_t size, Chunk* chunk);
+
+#endif
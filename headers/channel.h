@@ -0,0 +1,33 @@
+#ifndef potato_channel_h
+#define potato_channel_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// A channel is a bounded queue that isolates on any threads pass values
+// through. It lives outside every heap and is reference counted: each
+// ObjChannel handle holds one reference, and so does each channel still
+// queued inside another channel. A channel that ends up queued inside
+// itself is never freed.
+//
+// Values are copied across: numbers, booleans and nil as they are, and
+// strings as their characters, which the receiving VM interns. A shared
+// symbol crosses as a pointer and is never copied.
+
+// Holds at most capacity values. The caller holds one reference.
+Channel* newChannel(int capacity);
+void retainChannel(Channel* channel);
+void releaseChannel(Channel* channel);
+
+// Natives for scripts, taking the channel as their first argument.
+// channel(capacity) makes a new one; send and receive wait for room or a
+// value, trySend returns whether there was room, and tryReceive returns
+// nil when the channel is empty.
+bool channelNative(Value* args, Value* result);
+bool sendNative(Value* args, Value* result);
+bool trySendNative(Value* args, Value* result);
+bool receiveNative(Value* args, Value* result);
+bool tryReceiveNative(Value* args, Value* result);
+
+#endif
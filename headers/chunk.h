@@ -4,6 +4,8 @@
 #include "common.h"
 #include "value.h"
 
+// Bytecode images store these numbers, so renumbering or inserting an
+// opcode means bumping BYTECODE_VERSION in bytecode.h.
 typedef enum {
     OP_CONSTANT,
     OP_CONSTANT_LONG,
@@ -30,8 +32,40 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    // for (var i = ...; i < bound; i = i + step). PREP tests the counter
+    // once and jumps past the loop if it is already done; LOOP steps it and
+    // jumps back to the body while it is below the bound. Operands:
+    //   OP_FOR_NUM_PREP  counter, bound kind, bound, exit offset (16)
+    //   OP_FOR_NUM_LOOP  counter, bound kind, bound, step constant, back offset (16)
+    OP_FOR_NUM_PREP,
+    OP_FOR_NUM_LOOP,
+    // a + b + ... with count operands (3 to 255), adding numbers or
+    // concatenating strings in one step.
+    OP_CONCAT_N,
+    // Calls the native function below its argCount (0 to 255) arguments,
+    // replacing them all with the result.
+    OP_CALL,
+    // Only produced by the optimizer.
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_SET_LOCAL_POP,
+    OP_INC_LOCAL_CONST,
+    OP_LESS_LOCAL_CONST_JUMP,
+    OP_GET_LOCAL_GET_LOCAL,
+    // Only produced by the interpreter, which rewrites a generic opcode in
+    // place once it has seen the operand types.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
 } OpCode;
 
+// How OP_FOR_NUM_* read their bound operand.
+#define FOR_BOUND_CONSTANT 0
+#define FOR_BOUND_LOCAL    1
+
 typedef struct {
     int first;
     int second;
@@ -45,6 +79,9 @@ typedef struct {
     int lineCapacity;
     int lineCount;
     intPair* lines; // [[1,2],[2,1],[3,4]] -> 1, 1, 2, 3, 3, 3, 3 
+    // code and lines point into a loaded bytecode image or a Program: they
+    // are not freed with the chunk and the interpreter must not rewrite them.
+    bool readOnly;
 } Chunk;
 
 
@@ -54,5 +91,12 @@ void freeChunk(Chunk* chunk);
 
 int addConstant(Chunk* chunk, Value value);
 void writeConstant(Chunk* chunk, Value value, int line);
+int instructionLength(uint8_t instruction);
+void truncateChunk(Chunk* chunk, int count);
+// Gives a read-only chunk its own copy of the code and line runs.
+void ownCode(Chunk* chunk);
+// Rewrites every global slot operand old below count to slots[old],
+// taking a private copy of read-only code first.
+void remapGlobals(Chunk* chunk, const int* slots, uint32_t count);
 
 #endif
\ No newline at end of file
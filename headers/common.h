@@ -4,6 +4,30 @@
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
+// Count executed opcode pairs and dump them on exit (make potato-pairs).
+// #define DEBUG_COUNT_PAIRS
+
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Values are NaN-boxed into a single 64-bit word by default; define
+// NO_NAN_BOXING to fall back to the tagged struct representation.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// Threaded dispatch in run() needs GCC's labels-as-values extension;
+// define NO_COMPUTED_GOTO to force the portable switch loop.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Baseline JIT (--jit): x86-64 Linux only, and it relies on NaN boxing.
+// Define NO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -5,5 +5,6 @@
 #include "vm.h"
 
 bool compile(const char* source, Chunk* chunk);
+void markCompilerRoots();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef potato_jit_h
+#define potato_jit_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// Set by --jit. Ignored by builds without JIT support.
+extern bool jitEnabled;
+
+// Translates chunk to native code and runs it from vm->sp. Returns false,
+// without running anything, when the chunk holds an opcode the JIT cannot
+// translate or this build has no JIT; the caller then interprets it.
+bool jitRun(Chunk* chunk, InterpretResult* result);
+
+// Set by --trace-jit. Ignored by builds without JIT support.
+extern bool traceJitEnabled;
+
+typedef enum {
+    TRACE_NONE,     // keep interpreting
+    TRACE_RECORD,   // call jitRecord() before each instruction from here on
+    TRACE_EXITED,   // a trace ran; resume from vm->ip and vm->sp
+    TRACE_ERROR,    // a trace ran into a runtime error, already reported
+} TraceAction;
+
+// Called by run() on every taken OP_LOOP, with ip already at the loop
+// header; runs the loop's trace if it has one.
+TraceAction jitLoopEdge(uint8_t* header, Value* sp);
+// Called by run() before each instruction while recording. Returns false
+// once the recording is finished or abandoned.
+bool jitRecord(uint8_t* ip, Value* sp);
+// Drops the traces of the chunk that just ran.
+void jitFreeTraces();
+// Frees the VM's recorder along with any traces.
+void jitFreeTracer();
+
+#endif
@@ -20,6 +20,135 @@ void* reallocate(void* ptr, size_t oldSize, size_t newSize);
 #define FREE(type, ptr) \
     reallocate(ptr, sizeof(type), 0)
 
+// A bump allocator for scratch data that dies all at once, such as the
+// optimizer's working copy of a chunk. Arena memory bypasses reallocate(),
+// so it neither counts toward nor triggers collections.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;
+    char* cursor;
+    char* limit;
+} Arena;
+
+void initArena(Arena* arena);
+void* arenaAllocate(Arena* arena, size_t size);
+void freeArena(Arena* arena);
+
+#define ARENA_ALLOCATE(arena, type, count) \
+    (type*)arenaAllocate((arena), sizeof(type) * (count))
+
+// Allocator and collector state, one of each per VM. Only memory.c looks
+// inside; its comments describe how each part works.
+#ifndef NO_POOL_ALLOC
+#define POOL_CLASSES 16
+
+typedef struct FreeBlock FreeBlock;
+typedef struct Slab Slab;
+
+typedef struct {
+    FreeBlock* freeLists[POOL_CLASSES];
+    Slab* slabs;
+    char* cursor;   // uncarved space in the newest slab
+    char* limit;
+
+    size_t smallAllocs;
+    size_t freeListHits;
+    size_t largeAllocs;
+    size_t slabCount;
+    size_t liveRequested;  // bytes asked for by live small blocks
+    size_t liveBlocks;     // bytes those blocks actually occupy
+    size_t peakBlocks;
+} Pool;
+#endif
+
+typedef struct {
+    char* base;
+    char* cursor;
+    char* limit;
+    bool open;
+    // Set when the reservation ran out; the rest of the call allocates
+    // from the heap.
+    bool exhausted;
+
+    int requests;
+    int exhaustions;
+    size_t peakUsed;
+} Region;
+
+typedef struct {
+    char* start;
+    char* cursor;
+    char* end;
+    bool enabled;
+
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+
+    ObjString** interned;
+    int internedCount;
+    int internedCapacity;
+
+    // Copied ropes whose fields still point into the nursery.
+    Obj** pending;
+    int pendingCount;
+    int pendingCapacity;
+} Nursery;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GCPhase;
+
+typedef struct {
+    GCPhase phase;
+    // Globals below this slot have been marked.
+    uint32_t globalCursor;
+    // The list being swept; objects allocated meanwhile go on vm->objects.
+    Obj* unswept;
+    Obj* swept;
+    Obj* sweptTail;
+    size_t nextStep;
+} Collector;
+
+// Request-scoped allocation: while the region is open every block
+// reallocate() hands out comes from it, and releaseRegion() drops all of
+// them at once. Between closeRegion() and releaseRegion() the caller
+// promotes whatever must survive by resizing it out of the region.
+void openRegion();
+void closeRegion();
+void releaseRegion();
+bool inRegion(const void* ptr);
+void freeRegion();
+
+// Generational allocation; see the nursery in memory.c.
+void enableNursery(bool enabled);
+void* allocateObjectMemory(size_t size);
+// Always from the heap, for objects that must be freed one by one.
+void* allocatePinnedMemory(size_t size);
+bool isYoung(const void* ptr);
+// Call after storing value into a field of owner.
+void writeBarrier(Obj* owner, Obj* value);
+void rememberInterned(ObjString* string);
+// Only at a safepoint: moves every reachable young object.
+void collectYoung();
+// Forgets every young object, keeping the nursery's memory.
+void resetNursery();
+void freeNursery();
+
+void markObject(Obj* object);
+void markValue(Value value);
+// Runs a whole major collection at once, finishing the incremental cycle
+// in progress if there is one.
+void collectGarbage();
+void finishCollection();
+// Call on a string found in vm->strings, which is weak.
+void retainInterned(ObjString* string);
+void printGCStats();
+void printAllocStats();
 void freeObjects();
+void freePool();
 
 #endif
@@ -8,32 +8,99 @@
 #include "chunk.h"
 #include "value.h"
 
+// The text types come first; IS_TEXT relies on it.
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_NATIVE,
+    OBJ_CHANNEL,
 } ObjectType;
 
 struct Obj{
     ObjectType type;
+    bool isMarked;
     Obj* next;
 };
 
+// The characters live in the same allocation as the header.
 struct ObjString{
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
+// The result of a long concatenation, kept as a tree over its operands
+// (strings or other ropes) until something needs the characters in one
+// piece. Flattening caches the interned string in flat and drops the
+// children.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+// Reads its arguments from args and stores what it returns in result.
+// Returns false after reporting a runtime error.
+typedef bool (*NativeFn)(Value* args, Value* result);
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+    int arity;
+} ObjNative;
+
+// Shared between isolates; see channel.h.
+typedef struct Channel Channel;
+
+// One VM's handle on a channel, holding a reference to it.
+typedef struct {
+    Obj obj;
+    Channel* channel;
+} ObjChannel;
+
 ObjString* copyString(const char* chars, int length);
+// Like copyString(), for identifier names and string constants: with
+// sharedSymbols set, the string is the process-wide symbol.
+ObjString* copySymbol(const char* chars, int length);
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+// Strings and ropes are the same type as far as scripts can tell.
+#define IS_TEXT(value) (IS_OBJ(value) && AS_OBJ(value)->type <= OBJ_ROPE)
 
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_CHANNEL(value)      (((ObjChannel*)AS_OBJ(value))->channel)
 
 void printObject(Value value);
-ObjString* takeString(char* chars, int length);
+// Builds a string in place: reserveString() returns one with room for
+// length characters for the caller to fill in, and internString() then
+// hashes it and returns the interned copy, freeing it if it was a
+// duplicate. The collector cannot see a string between the two calls.
+ObjString* reserveString(int length);
+ObjString* internString(ObjString* string);
+// Interns a frozen string from a Program in place of a copy, unless this
+// VM already has one with the same characters, which it returns instead.
+ObjString* adoptString(ObjString* frozen);
+ObjRope* newRope(Obj* left, Obj* right, int length);
+ObjNative* newNative(NativeFn function, int arity);
+// Takes over one reference to channel.
+ObjChannel* newChannelHandle(Channel* channel);
+// Length of a string or rope.
+int textLength(Obj* text);
+// The string holding text's characters. Flattening a rope allocates, so
+// the rope must be reachable from a root.
+ObjString* flattenText(Obj* text);
 
 static inline bool isObjType(Value value, ObjectType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,12 @@
+#ifndef potato_optimizer_h
+#define potato_optimizer_h
+
+#include "chunk.h"
+
+// 0 leaves compiled chunks untouched, 1 runs the peephole pass, 2 also
+// fuses hot instruction sequences into superinstructions.
+extern int optimizeLevel;
+
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef potato_program_h
+#define potato_program_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// Copies a freshly compiled chunk, and the global names of the VM that
+// compiled it, into one read-only mapping that any VM can run.
+Program* freezeProgram(Chunk* chunk);
+// Sets chunk up to run program on the current VM: the code is shared
+// unless the VM's global slots differ from the program's, and constants
+// refer to the program's frozen strings.
+void thawProgram(const Program* program, Chunk* chunk);
+
+#endif
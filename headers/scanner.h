@@ -6,7 +6,14 @@
 
 #include "common.h"
 
-void initScanner(const char* source);
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
+// The compiler can look ahead and then rewind by copying a Scanner.
+void initScanner(Scanner* scanner, const char* source);
 
 typedef enum {
     // Single-character tokens.
@@ -37,7 +44,7 @@ typedef struct {
     int line;
 } Token;
 
-Token scanToken();
+Token scanToken(Scanner* scanner);
 
 
 
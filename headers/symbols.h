@@ -0,0 +1,27 @@
+#ifndef potato_symbols_h
+#define potato_symbols_h
+
+#include "common.h"
+#include "object.h"
+
+// A process-wide intern table for the strings compilers and bytecode
+// loaders create: identifier names and string constants. Every isolate
+// shares one immutable copy of each, and finds it without locking.
+//
+// Each VM still interns everything else privately, and looks in its own
+// table before this one, so within one VM equal strings stay the same
+// pointer.
+
+// Set by initSymbols(), which must run before any VM does.
+extern bool sharedSymbols;
+
+void initSymbols();
+// Frees every symbol; no VM may be running or hold one.
+void freeSymbols();
+ObjString* findSymbol(const char* chars, int length, uint32_t hash);
+// Returns the symbol for chars, publishing a new one if no isolate has
+// yet. Returns NULL once the table is full.
+ObjString* internSymbol(const char* chars, int length, uint32_t hash);
+void printSymbolStats();
+
+#endif
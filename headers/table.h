@@ -9,18 +9,27 @@ typedef struct {
     Value value;
 } Entry;
 
+// Open addressing over power-of-two capacities, probed a group of 16
+// control bytes at a time. control[i] is CTRL_EMPTY, CTRL_DELETED, or the
+// low 7 bits of the key's hash when entries[i] is in use.
 typedef struct {
+    uint8_t* control;
     Entry* entries;
     int count;
+    int tombstones;
     int capacity;
 } Table;
 
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
+// Grows the table once so that count more keys fit without resizing.
+void tableReserve(Table* table, int count);
 void tableAddAll(Table* from, Table* to);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+// Swaps key for to, which must have the same hash.
+void tableRekey(Table* table, ObjString* key, ObjString* to);
 
-#endif
\ No newline at end of file
+#endif
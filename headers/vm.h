@@ -2,28 +2,106 @@
 #define potato_vm_h
 
 #include <stdarg.h>
+#include <stdio.h>
 
 #include "common.h"
 #include "value.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 
 #define STACK_MAX 256
+#define GC_PAUSE_BUCKETS 24
 
+typedef struct Tracer Tracer;
+
+// One isolate: a VM shares no mutable state with any other, so each thread
+// can run its own without locks.
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;
     Value stack[STACK_MAX];
     Value* sp;
+    // Where print and error messages go; stdout and stderr by default.
+    FILE* out;
+    FILE* err;
     Table strings;
     Obj* objects;
-    Table globals;
+    // Objects allocated in the request region; see arenaMode.
+    Obj* regionObjects;
+
+    // Globals live in a dense array indexed by a slot the compiler assigns
+    // per name; globalSlots maps each name to its slot and globalNames
+    // keeps the name for error messages.
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
+
+    size_t bytesAllocated;
+    size_t nextGC;
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+    // Longest a major collection step may run, in milliseconds; 0 runs
+    // each collection to completion in one pause.
+    double gcPauseBudget;
+    // Set while an incremental cycle is marking; stores into globals and
+    // tables must then mark the stored value.
+    bool gcMarking;
+
+    // Runs each interpret() call in a request region that is released when
+    // the call returns, promoting only what globals still reference.
+    bool arenaMode;
+
+    // Bytes in the nursery; 0 allocates everything in the heap. Set before
+    // the first interpret().
+    size_t nurserySize;
+    // Set when an allocation found the nursery full; the next safepoint
+    // runs collectYoung().
+    bool nurseryFull;
+
+    bool gcStats;
+    bool allocStats;
+    int gcCount;
+    size_t gcBytesFreed;
+    int gcPauseCount;
+    double gcPauseTotal;
+    double gcPauseMax;
+    // Every pause, major or minor, by power-of-two microseconds.
+    int gcPauseHistogram[GC_PAUSE_BUCKETS];
+    int minorCount;
+    size_t youngBytes;
+    size_t promotedBytes;
+    double minorPauseMax;
+
+    // The chunk being compiled, whose constants are roots.
+    Chunk* compilingChunk;
+    // The tracing JIT's recorder and traces, created on first use.
+    Tracer* tracer;
+
+#ifndef NO_POOL_ALLOC
+    Pool pool;
+#endif
+    Region region;
+    Nursery nursery;
+    Collector collector;
+    // Set while collectYoung() copies survivors into the heap, which must
+    // not start a full collection halfway through.
+    bool evacuating;
 } VM;
 
-extern VM vm;
+// The isolate running on this thread. The entry points below bind it for
+// the duration of the call, and everything they call reaches the VM
+// through it.
+extern _Thread_local VM* vm;
 
-void initVM();
-void exitVM();
+VM* potatoNewVM();
+// Prints any statistics the VM was asked for, then frees it and every
+// object it allocated.
+void potatoFreeVM(VM* isolate);
+// Drops every global and object so isolate can run an unrelated script,
+// keeping its pool slabs, nursery and statistics.
+void potatoResetVM(VM* isolate);
 
 typedef enum {
   INTERPRET_OK,
@@ -31,7 +109,42 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-InterpretResult interpret(const char* source);
+InterpretResult interpret(VM* isolate, const char* source);
+// Runs a chunk serialized by writeBytecode().
+InterpretResult interpretBytecode(VM* isolate, const uint8_t* bytes, size_t size);
+
+// A compiled script, immutable once built, that any number of VMs can run
+// at the same time on any threads without recompiling it.
+typedef struct Program Program;
+
+// Compiles source on a private VM. Reports errors to the err stream of
+// the VM bound on this thread, or stderr if there is none, and returns
+// NULL.
+Program* potatoCompile(const char* source);
+InterpretResult potatoRun(VM* isolate, const Program* program);
+// Every VM that ran program must be reset or freed first: their intern
+// tables and globals point at its strings.
+void potatoFreeProgram(Program* program);
+// Isolates cooperate through channels, which scripts use with the send
+// and receive natives; see channel.h. A channel the host creates reaches
+// a script as a global.
+Channel* potatoNewChannel(int capacity);
+void potatoReleaseChannel(Channel* channel);
+// Defines a global in isolate holding channel. Call it again after
+// potatoResetVM(), which drops every global.
+void potatoDefineChannel(VM* isolate, const char* name, Channel* channel);
+
+// Makes isolate the one running on this thread and returns the previous
+// one, for callers that use the VM outside interpret().
+VM* bindVM(VM* isolate);
+int globalSlot(ObjString* name);
+void runtimeError(const char* format, ...);
+// Both report a runtime error and return false if they fail.
+bool concatenate(Value string1, Value string2, Value* result);
+bool addMany(Value* operands, int count, Value* result);
+// Calls callee with the argCount values at args, which must be on the
+// stack, reporting a runtime error and returning false if it fails.
+bool callValue(Value callee, Value* args, int argCount, Value* result);
 void push(Value value);
 Value pop();
 
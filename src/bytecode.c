@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "table.h"
+#include "vm.h"
+
+// An image is laid out to be mapped read-only and run in place. All
+// integers are little-endian and every section starts 8-byte aligned:
+//   header     "POTC" version:u32 optimizeLevel:u32 reserved:u32
+//              sourceHash:u64 (offset:u32 count:u32)[5]
+//   code       count bytes, executed where they lie
+//   lines      (line:u32 run:u32)[count], the chunk's intPair runs as is
+//   globals    (offset:u32 length:u32)[count] names, in slot order
+//   constants  (tag:u32 length:u32 payload:u64)[count]
+//   strings    count bytes of characters
+// The offset/count pairs locate the five sections in that order. Names
+// and string constants refer to the strings section by offset, so nothing
+// in the image holds a pointer. A number constant's payload is the bits of
+// the double; a string's is its offset, with the length alongside.
+#define MAGIC "POTC"
+#define HEADER_SIZE 64
+#define SECTION_ALIGN 8
+
+typedef enum {
+    SECTION_CODE,
+    SECTION_LINES,
+    SECTION_GLOBALS,
+    SECTION_CONSTANTS,
+    SECTION_STRINGS,
+    SECTION_COUNT,
+} SectionKind;
+
+// Entry sizes; the strings section and code are counted in bytes.
+#define LINE_SIZE     8
+#define GLOBAL_SIZE   8
+#define CONSTANT_SIZE 16
+
+typedef enum {
+    CONST_NUMBER,
+    CONST_STRING,
+    CONST_NIL,
+    CONST_FALSE,
+    CONST_TRUE,
+} ConstantTag;
+
+uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+static void putBytes(Buffer* buffer, const void* bytes, size_t count) {
+    if(count == 0) return;
+    if(buffer->count + count > buffer->capacity) {
+        while(buffer->count + count > buffer->capacity) {
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        }
+        // Only lives until the file is written, so it bypasses reallocate().
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+        if(buffer->bytes == NULL) exit(1);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void putU32(Buffer* buffer, uint32_t value) {
+    uint8_t bytes[4];
+    for(int i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (8 * i));
+    putBytes(buffer, bytes, 4);
+}
+
+static void putU64(Buffer* buffer, uint64_t value) {
+    putU32(buffer, (uint32_t)value);
+    putU32(buffer, (uint32_t)(value >> 32));
+}
+
+static void patchU32(Buffer* buffer, size_t at, uint32_t value) {
+    for(int i = 0; i < 4; i++) buffer->bytes[at + i] = (uint8_t)(value >> (8 * i));
+}
+
+static void alignBuffer(Buffer* buffer) {
+    static const uint8_t zeros[SECTION_ALIGN] = {0};
+    putBytes(buffer, zeros, (SECTION_ALIGN - buffer->count % SECTION_ALIGN) % SECTION_ALIGN);
+}
+
+static void beginSection(Buffer* buffer, SectionKind kind, uint32_t count) {
+    alignBuffer(buffer);
+    patchU32(buffer, 24 + kind * 8, (uint32_t)buffer->count);
+    patchU32(buffer, 28 + kind * 8, count);
+}
+
+// Appends string's characters to the strings section and returns where
+// they start.
+static uint32_t putString(Buffer* strings, ObjString* string) {
+    uint32_t offset = (uint32_t)strings->count;
+    putBytes(strings, string->chars, string->length);
+    return offset;
+}
+
+static void putConstant(Buffer* buffer, Buffer* strings, Value value) {
+    if(IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        putU32(buffer, CONST_NUMBER);
+        putU32(buffer, 0);
+        putU64(buffer, bits);
+    } else if(IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        putU32(buffer, CONST_STRING);
+        putU32(buffer, (uint32_t)string->length);
+        putU64(buffer, putString(strings, string));
+    } else {
+        putU32(buffer, IS_NIL(value) ? CONST_NIL : AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+        putU32(buffer, 0);
+        putU64(buffer, 0);
+    }
+}
+
+bool writeBytecode(Chunk* chunk, uint64_t sourceHash, const char* path) {
+    Buffer buffer = {NULL, 0, 0};
+    Buffer strings = {NULL, 0, 0};
+    putBytes(&buffer, MAGIC, 4);
+    putU32(&buffer, BYTECODE_VERSION);
+    putU32(&buffer, (uint32_t)optimizeLevel);
+    putU32(&buffer, 0);
+    putU64(&buffer, sourceHash);
+    for(int i = 0; i < SECTION_COUNT; i++) putU64(&buffer, 0);
+
+    beginSection(&buffer, SECTION_CODE, (uint32_t)chunk->count);
+    putBytes(&buffer, chunk->code, chunk->count);
+
+    beginSection(&buffer, SECTION_LINES, (uint32_t)chunk->lineCount);
+    for(int i = 0; i < chunk->lineCount; i++) {
+        putU32(&buffer, (uint32_t)chunk->lines[i].first);
+        putU32(&buffer, (uint32_t)chunk->lines[i].second);
+    }
+
+    beginSection(&buffer, SECTION_GLOBALS, vm->globalNames.count);
+    for(uint32_t i = 0; i < vm->globalNames.count; i++) {
+        ObjString* name = AS_STRING(vm->globalNames.values[i]);
+        putU32(&buffer, putString(&strings, name));
+        putU32(&buffer, (uint32_t)name->length);
+    }
+
+    beginSection(&buffer, SECTION_CONSTANTS, chunk->constants.count);
+    for(uint32_t i = 0; i < chunk->constants.count; i++) {
+        putConstant(&buffer, &strings, chunk->constants.values[i]);
+    }
+
+    beginSection(&buffer, SECTION_STRINGS, (uint32_t)strings.count);
+    putBytes(&buffer, strings.bytes, strings.count);
+
+    FILE* file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+    if(file != NULL && fclose(file) != 0) written = false;
+    free(buffer.bytes);
+    free(strings.bytes);
+    return written;
+}
+
+static uint32_t readU32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t readU64(const uint8_t* bytes) {
+    return readU32(bytes) | (uint64_t)readU32(bytes + 4) << 32;
+}
+
+typedef struct {
+    const uint8_t* start;
+    uint32_t count;
+} Section;
+
+// A validated view of an image. Everything past parseImage() can index
+// into it without further bounds checks, and its code can run as it lies:
+// readBytecode() points a chunk at it only once parseImage() has passed.
+typedef struct {
+    uint32_t optimizedAt;
+    uint64_t sourceHash;
+    Section sections[SECTION_COUNT];
+    int strings;
+} Image;
+
+static bool parseHeader(const uint8_t* bytes, size_t size, Image* image) {
+    if(size < HEADER_SIZE || memcmp(bytes, MAGIC, 4) != 0) return false;
+    if(readU32(bytes + 4) != BYTECODE_VERSION) return false;
+    image->optimizedAt = readU32(bytes + 8);
+    image->sourceHash = readU64(bytes + 16);
+    return true;
+}
+
+static bool inStrings(Image* image, uint32_t offset, uint32_t length) {
+    uint32_t size = image->sections[SECTION_STRINGS].count;
+    return offset <= size && length <= size - offset;
+}
+
+static uint32_t readShort(const uint8_t* bytes) {
+    return (uint32_t)(bytes[0] << 8 | bytes[1]);
+}
+
+static bool constantIndex(Image* image, uint32_t index) {
+    return index < image->sections[SECTION_CONSTANTS].count;
+}
+
+// The bound of an OP_FOR_NUM_* is a local slot or a constant index.
+static bool forBound(Image* image, const uint8_t* operands) {
+    if(operands[0] == FOR_BOUND_LOCAL) return true;
+    return operands[0] == FOR_BOUND_CONSTANT && constantIndex(image, operands[1]);
+}
+
+// Checks the constant and global operands of instruction.
+static bool operandsValid(Image* image, const uint8_t* instruction) {
+    switch (instruction[0]) {
+        case OP_CONSTANT:
+            return constantIndex(image, instruction[1]);
+        case OP_CONSTANT_LONG:
+            return constantIndex(image, instruction[1] | instruction[2] << 8 | instruction[3] << 16);
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            return readShort(instruction + 1) < image->sections[SECTION_GLOBALS].count;
+        case OP_INC_LOCAL_CONST:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return constantIndex(image, instruction[2]);
+        case OP_FOR_NUM_PREP:
+            return forBound(image, instruction + 2);
+        case OP_FOR_NUM_LOOP:
+            return forBound(image, instruction + 2) && constantIndex(image, instruction[4]);
+        default:
+            return true;
+    }
+}
+
+// Moves depth past instruction, failing if it takes more values than the
+// stack holds, reads a local slot above the top, or overflows the stack.
+static bool stepDepth(const uint8_t* instruction, int* depth) {
+    int pops = 0;
+    int pushes = 0;
+    int highestLocal = -1;
+    switch (instruction[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+            pushes = 1;
+            break;
+        case OP_GET_LOCAL:
+            highestLocal = instruction[1];
+            pushes = 1;
+            break;
+        case OP_GET_LOCAL_GET_LOCAL:
+            highestLocal = instruction[1] > instruction[2] ? instruction[1] : instruction[2];
+            pushes = 2;
+            break;
+        case OP_SET_LOCAL:
+            highestLocal = instruction[1];
+            pops = pushes = 1;
+            break;
+        case OP_SET_LOCAL_POP:
+            highestLocal = instruction[1];
+            pops = 1;
+            break;
+        case OP_INC_LOCAL_CONST:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            highestLocal = instruction[1];
+            break;
+        case OP_FOR_NUM_PREP:
+        case OP_FOR_NUM_LOOP:
+            highestLocal = instruction[1];
+            if(instruction[2] == FOR_BOUND_LOCAL && instruction[3] > highestLocal) {
+                highestLocal = instruction[3];
+            }
+            break;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+            pops = pushes = 1;
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+            pops = 1;
+            break;
+        case OP_CONCAT_N:
+            pops = instruction[1];
+            pushes = 1;
+            break;
+        case OP_CALL:
+            pops = instruction[1] + 1;
+            pushes = 1;
+            break;
+        default:
+            break;
+    }
+    if(highestLocal >= *depth || pops > *depth) return false;
+    *depth += pushes - pops;
+    return *depth <= STACK_MAX;
+}
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_LESS_LOCAL_CONST_JUMP:
+        case OP_FOR_NUM_PREP:
+        case OP_FOR_NUM_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+#define NOT_INSTRUCTION -2
+#define DEPTH_UNKNOWN -1
+
+// Where a jump lands, or -1 if that is outside the code. Its offset is its
+// last two bytes, counted from the next instruction.
+static int64_t jumpTarget(const uint8_t* instruction, uint32_t offset, uint32_t length, uint32_t count) {
+    int64_t next = offset + length;
+    uint32_t jump = readShort(instruction + length - 2);
+    bool backward = instruction[0] == OP_LOOP || instruction[0] == OP_FOR_NUM_LOOP;
+    int64_t target = backward ? next - jump : next + jump;
+    return target >= 0 && target < count ? target : -1;
+}
+
+// Checks the code as run() will trust it: every instruction is whole and
+// unspecialized, the last is OP_RETURN, every constant index and global
+// slot exists, and every jump lands on an instruction. Then it follows
+// every path from the start, tracking the stack depth, which must agree
+// wherever paths meet, so no instruction takes values or reads locals
+// that are not there.
+static bool checkCode(Image* image) {
+    Section* code = &image->sections[SECTION_CODE];
+    if(code->count == 0) return false;
+    int* depths = (int*)malloc(sizeof(int) * code->count);
+    uint32_t* pending = (uint32_t*)malloc(sizeof(uint32_t) * code->count);
+    if(depths == NULL || pending == NULL) exit(1);
+    for(uint32_t i = 0; i < code->count; i++) depths[i] = NOT_INSTRUCTION;
+    uint32_t last = 0;
+    bool valid = true;
+    for(uint32_t offset = 0; valid && offset < code->count;) {
+        uint8_t instruction = code->start[offset];
+        depths[offset] = DEPTH_UNKNOWN;
+        last = offset;
+        offset += instructionLength(instruction);
+        valid = instruction < OP_ADD_NUM && offset <= code->count;
+    }
+    valid = valid && code->start[last] == OP_RETURN;
+
+    for(uint32_t offset = 0; valid && offset < code->count;) {
+        const uint8_t* instruction = code->start + offset;
+        uint32_t length = (uint32_t)instructionLength(instruction[0]);
+        valid = operandsValid(image, instruction);
+        if(valid && isJump(instruction[0])) {
+            int64_t target = jumpTarget(instruction, offset, length, code->count);
+            valid = target >= 0 && depths[target] != NOT_INSTRUCTION;
+        }
+        offset += length;
+    }
+
+    // Each instruction is queued at most once, when its depth is first known.
+    int pendingCount = 0;
+    if(valid) {
+        depths[0] = 0;
+        pending[pendingCount++] = 0;
+    }
+    while(valid && pendingCount > 0) {
+        uint32_t offset = pending[--pendingCount];
+        int depth = depths[offset];
+        for(;;) {
+            const uint8_t* instruction = code->start + offset;
+            uint32_t length = (uint32_t)instructionLength(instruction[0]);
+            valid = stepDepth(instruction, &depth);
+            if(!valid) break;
+            if(isJump(instruction[0])) {
+                int64_t target = jumpTarget(instruction, offset, length, code->count);
+                if(depths[target] == DEPTH_UNKNOWN) {
+                    depths[target] = depth;
+                    pending[pendingCount++] = (uint32_t)target;
+                } else if(depths[target] != depth) {
+                    valid = false;
+                    break;
+                }
+            }
+            // OP_RETURN is last, so any other instruction has a next one.
+            if(instruction[0] == OP_JUMP || instruction[0] == OP_LOOP || instruction[0] == OP_RETURN) break;
+            offset += length;
+            if(depths[offset] != DEPTH_UNKNOWN) {
+                valid = depths[offset] == depth;
+                break;
+            }
+            depths[offset] = depth;
+        }
+    }
+    free(pending);
+    free(depths);
+    return valid;
+}
+
+// Checks every section lies inside the file, the code is well formed (see
+// checkCode()), and every string reference lies inside the strings
+// section. Counts the strings so vm->strings can be grown once for all of them.
+static bool parseImage(const uint8_t* bytes, size_t size, Image* image) {
+    static const size_t entrySizes[SECTION_COUNT] = {1, LINE_SIZE, GLOBAL_SIZE, CONSTANT_SIZE, 1};
+    if(!parseHeader(bytes, size, image)) return false;
+    for(int i = 0; i < SECTION_COUNT; i++) {
+        uint32_t offset = readU32(bytes + 24 + i * 8);
+        uint32_t count = readU32(bytes + 28 + i * 8);
+        if(offset < HEADER_SIZE || offset % SECTION_ALIGN != 0 || offset > size ||
+           count > (size - offset) / entrySizes[i]) {
+            return false;
+        }
+        image->sections[i].start = bytes + offset;
+        image->sections[i].count = count;
+    }
+
+    if(!checkCode(image)) return false;
+
+    Section* globals = &image->sections[SECTION_GLOBALS];
+    for(uint32_t i = 0; i < globals->count; i++) {
+        const uint8_t* entry = globals->start + i * GLOBAL_SIZE;
+        if(!inStrings(image, readU32(entry), readU32(entry + 4))) return false;
+    }
+    image->strings = (int)globals->count;
+
+    Section* constants = &image->sections[SECTION_CONSTANTS];
+    for(uint32_t i = 0; i < constants->count; i++) {
+        const uint8_t* entry = constants->start + i * CONSTANT_SIZE;
+        switch (readU32(entry)) {
+            case CONST_STRING:
+                if(readU64(entry + 8) > UINT32_MAX ||
+                   !inStrings(image, (uint32_t)readU64(entry + 8), readU32(entry + 4))) {
+                    return false;
+                }
+                image->strings++;
+                break;
+            case CONST_NUMBER:
+            case CONST_NIL:
+            case CONST_FALSE:
+            case CONST_TRUE:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// A damaged cache fails parseImage() here, so the caller can fall back to
+// the source instead of reporting it.
+bool bytecodeFresh(const uint8_t* bytes, size_t size, uint64_t sourceHash) {
+    Image image;
+    return parseHeader(bytes, size, &image) && image.optimizedAt == (uint32_t)optimizeLevel &&
+           image.sourceHash == sourceHash && parseImage(bytes, size, &image);
+}
+
+static ObjString* imageString(Image* image, uint32_t offset, uint32_t length) {
+    const char* chars = (const char*)image->sections[SECTION_STRINGS].start + offset;
+    return copySymbol(chars, (int)length);
+}
+
+static bool hostLittleEndian() {
+    uint16_t one = 1;
+    return *(uint8_t*)&one == 1;
+}
+
+// Points the chunk straight at the image's code and line runs. Their
+// layout matches Chunk's own on a little-endian host; anywhere else, or
+// if the caller's buffer is misaligned, they are copied instead. Nothing
+// checks the code after this, so image must have passed parseImage().
+static void loadCode(Image* image, Chunk* chunk) {
+    Section* code = &image->sections[SECTION_CODE];
+    Section* lines = &image->sections[SECTION_LINES];
+    chunk->count = (int)code->count;
+    chunk->lineCount = (int)lines->count;
+    if(hostLittleEndian() && (uintptr_t)lines->start % _Alignof(intPair) == 0) {
+        chunk->code = (uint8_t*)code->start;
+        chunk->capacity = chunk->count;
+        chunk->lines = (intPair*)lines->start;
+        chunk->lineCapacity = chunk->lineCount;
+        chunk->readOnly = true;
+        return;
+    }
+
+    chunk->code = ALLOCATE(uint8_t, code->count);
+    chunk->capacity = chunk->count;
+    memcpy(chunk->code, code->start, code->count);
+    chunk->lines = ALLOCATE(intPair, lines->count);
+    chunk->lineCapacity = chunk->lineCount;
+    for(uint32_t i = 0; i < lines->count; i++) {
+        chunk->lines[i].first = (int)readU32(lines->start + i * LINE_SIZE);
+        chunk->lines[i].second = (int)readU32(lines->start + i * LINE_SIZE + 4);
+    }
+}
+
+// A fresh VM hands out the same slots in the same order, but one that has
+// already defined globals may not; rewrite the slot operands then.
+static void bindGlobals(Image* image, Chunk* chunk) {
+    Section* globals = &image->sections[SECTION_GLOBALS];
+    uint32_t count = globals->count;
+    int* slots = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+    if(slots == NULL) exit(1);
+    bool moved = false;
+    for(uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = globals->start + i * GLOBAL_SIZE;
+        slots[i] = globalSlot(imageString(image, readU32(entry), readU32(entry + 4)));
+        if(slots[i] != (int)i) moved = true;
+    }
+
+    if(moved) remapGlobals(chunk, slots, count);
+    free(slots);
+}
+
+static Value imageConstant(Image* image, const uint8_t* entry) {
+    switch (readU32(entry)) {
+        case CONST_NUMBER: {
+            uint64_t bits = readU64(entry + 8);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case CONST_STRING:
+            return OBJ_VAL(imageString(image, (uint32_t)readU64(entry + 8), readU32(entry + 4)));
+        case CONST_FALSE: return BOOL_VAL(false);
+        case CONST_TRUE:  return BOOL_VAL(true);
+        default:          return NIL_VAL;
+    }
+}
+
+bool readBytecode(const uint8_t* bytes, size_t size, Chunk* chunk) {
+    Image image;
+    if(!parseImage(bytes, size, &image)) return false;
+
+    loadCode(&image, chunk);
+    tableReserve(&vm->strings, image.strings);
+    bindGlobals(&image, chunk);
+    Section* constants = &image.sections[SECTION_CONSTANTS];
+    for(uint32_t i = 0; i < constants->count; i++) {
+        addConstant(chunk, imageConstant(&image, constants->start + i * CONSTANT_SIZE));
+    }
+    return true;
+}
@@ -0,0 +1,269 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "object.h"
+#include "symbols.h"
+#include "vm.h"
+
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+// A blocked sender or receiver yields this many times before it starts
+// sleeping between attempts.
+#define CHANNEL_SPINS 64
+#define CHANNEL_SLEEP_NS 50000
+#define CACHE_LINE 64
+
+typedef enum {
+    MESSAGE_NIL,
+    MESSAGE_BOOL,
+    MESSAGE_NUMBER,
+    // chars is a malloc'd copy that the message owns.
+    MESSAGE_STRING,
+    // A shared symbol, which outlives every channel.
+    MESSAGE_SYMBOL,
+    // The message owns one reference.
+    MESSAGE_CHANNEL,
+} MessageType;
+
+typedef struct {
+    MessageType type;
+    int length;
+    union {
+        bool boolean;
+        double number;
+        char* chars;
+        ObjString* symbol;
+        Channel* channel;
+    } as;
+} Message;
+
+typedef struct {
+    atomic_size_t sequence;
+    Message message;
+} ChannelSlot;
+
+// Dmitry Vyukov's bounded queue. Each slot's sequence number says whose
+// turn it is: position p may be written once the sequence reads p, and
+// read once it reads p + 1. Senders and receivers each claim positions by
+// compare-and-swap on their own counter, so any number of either can use
+// a channel without locks; one receiver with one or many senders is just
+// the common case. The counters sit on separate cache lines so that the
+// two ends do not contend.
+//
+// The ring is a power of two so positions map to slots with a mask, but
+// a sender also stops once capacity values are waiting, so a channel
+// holds exactly what it was asked to.
+struct Channel {
+    atomic_int references;
+    size_t capacity;
+    size_t mask;
+    _Alignas(CACHE_LINE) atomic_size_t sendPosition;
+    _Alignas(CACHE_LINE) atomic_size_t receivePosition;
+    _Alignas(CACHE_LINE) ChannelSlot slots[];
+};
+
+Channel* newChannel(int capacity) {
+    size_t size = 2;
+    while(size < (size_t)capacity) size *= 2;
+    Channel* channel = (Channel*)aligned_alloc(CACHE_LINE,
+        (sizeof(Channel) + sizeof(ChannelSlot) * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if(channel == NULL) exit(1);
+    atomic_init(&channel->references, 1);
+    channel->capacity = (size_t)capacity;
+    channel->mask = size - 1;
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    for(size_t i = 0; i < size; i++) atomic_init(&channel->slots[i].sequence, i);
+    return channel;
+}
+
+void retainChannel(Channel* channel) {
+    atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+static bool dequeue(Channel* channel, Message* message);
+
+static void freeMessage(Message* message) {
+    if(message->type == MESSAGE_STRING) free(message->as.chars);
+    if(message->type == MESSAGE_CHANNEL) releaseChannel(message->as.channel);
+}
+
+void releaseChannel(Channel* channel) {
+    if(atomic_fetch_sub_explicit(&channel->references, 1, memory_order_acq_rel) != 1) return;
+    Message message;
+    while(dequeue(channel, &message)) freeMessage(&message);
+    free(channel);
+}
+
+static bool enqueue(Channel* channel, Message* message) {
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    ChannelSlot* slot;
+    for(;;) {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0) {
+            // receivePosition only grows, so a stale read can only make
+            // the channel look fuller than it is.
+            size_t received = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+            if(position - received >= channel->capacity) return false;
+            if(atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+    slot->message = *message;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    return true;
+}
+
+static bool dequeue(Channel* channel, Message* message) {
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    ChannelSlot* slot;
+    for(;;) {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+    *message = slot->message;
+    atomic_store_explicit(&slot->sequence, position + channel->mask + 1, memory_order_release);
+    return true;
+}
+
+static void backOff(int* attempts) {
+    if(*attempts < CHANNEL_SPINS) {
+        (*attempts)++;
+        sched_yield();
+        return;
+    }
+    struct timespec pause = {0, CHANNEL_SLEEP_NS};
+    nanosleep(&pause, NULL);
+}
+
+static bool isSymbol(ObjString* string) {
+    return sharedSymbols && string->obj.isMarked &&
+           findSymbol(string->chars, string->length, string->hash) == string;
+}
+
+// value is one of the native's arguments, so flattening a rope is safe.
+static bool packMessage(Value value, Message* message) {
+    message->length = 0;
+    if(IS_NIL(value)) {
+        message->type = MESSAGE_NIL;
+    } else if(IS_BOOL(value)) {
+        message->type = MESSAGE_BOOL;
+        message->as.boolean = AS_BOOL(value);
+    } else if(IS_NUMBER(value)) {
+        message->type = MESSAGE_NUMBER;
+        message->as.number = AS_NUMBER(value);
+    } else if(IS_TEXT(value)) {
+        ObjString* string = flattenText(AS_OBJ(value));
+        message->length = string->length;
+        if(isSymbol(string)) {
+            message->type = MESSAGE_SYMBOL;
+            message->as.symbol = string;
+        } else {
+            message->type = MESSAGE_STRING;
+            message->as.chars = (char*)malloc(string->length > 0 ? string->length : 1);
+            if(message->as.chars == NULL) exit(1);
+            memcpy(message->as.chars, string->chars, string->length);
+        }
+    } else if(IS_CHANNEL(value)) {
+        message->type = MESSAGE_CHANNEL;
+        message->as.channel = AS_CHANNEL(value);
+        retainChannel(message->as.channel);
+    } else {
+        runtimeError("Only numbers, booleans, nil, strings and channels can be sent");
+        return false;
+    }
+    return true;
+}
+
+static Value unpackMessage(Message* message) {
+    switch (message->type) {
+        case MESSAGE_BOOL:   return BOOL_VAL(message->as.boolean);
+        case MESSAGE_NUMBER: return NUMBER_VAL(message->as.number);
+        case MESSAGE_STRING: {
+            ObjString* string = copyString(message->as.chars, message->length);
+            free(message->as.chars);
+            return OBJ_VAL(string);
+        }
+        // Finds this VM's own copy or the symbol itself; either way
+        // nothing is allocated.
+        case MESSAGE_SYMBOL:
+            return OBJ_VAL(copyString(message->as.symbol->chars, message->length));
+        case MESSAGE_CHANNEL:
+            return OBJ_VAL(newChannelHandle(message->as.channel));
+        default:
+            return NIL_VAL;
+    }
+}
+
+static bool channelArgument(Value value) {
+    if(IS_CHANNEL(value)) return true;
+    runtimeError("Expected a channel");
+    return false;
+}
+
+bool channelNative(Value* args, Value* result) {
+    if(!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 || AS_NUMBER(args[0]) > CHANNEL_MAX_CAPACITY ||
+       AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtimeError("Channel capacity must be a whole number from 1 to %d", CHANNEL_MAX_CAPACITY);
+        return false;
+    }
+    *result = OBJ_VAL(newChannelHandle(newChannel((int)AS_NUMBER(args[0]))));
+    return true;
+}
+
+bool sendNative(Value* args, Value* result) {
+    Message message;
+    if(!channelArgument(args[0]) || !packMessage(args[1], &message)) return false;
+    Channel* channel = AS_CHANNEL(args[0]);
+    for(int attempts = 0; !enqueue(channel, &message);) backOff(&attempts);
+    *result = NIL_VAL;
+    return true;
+}
+
+bool trySendNative(Value* args, Value* result) {
+    Message message;
+    if(!channelArgument(args[0]) || !packMessage(args[1], &message)) return false;
+    bool sent = enqueue(AS_CHANNEL(args[0]), &message);
+    if(!sent) freeMessage(&message);
+    *result = BOOL_VAL(sent);
+    return true;
+}
+
+bool receiveNative(Value* args, Value* result) {
+    if(!channelArgument(args[0])) return false;
+    Channel* channel = AS_CHANNEL(args[0]);
+    Message message;
+    for(int attempts = 0; !dequeue(channel, &message);) backOff(&attempts);
+    *result = unpackMessage(&message);
+    return true;
+}
+
+bool tryReceiveNative(Value* args, Value* result) {
+    if(!channelArgument(args[0])) return false;
+    Message message;
+    *result = dequeue(AS_CHANNEL(args[0]), &message) ? unpackMessage(&message) : NIL_VAL;
+    return true;
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -11,13 +12,16 @@ void initChunk(Chunk* chunk) {
     chunk->lines = NULL;
     chunk->lineCapacity = 0;
     chunk->lineCount = 0;
+    chunk->readOnly = false;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if(!chunk->readOnly) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(intPair, chunk->lines, chunk->lineCapacity);
+    }
     freeValueArray(&chunk->constants);
-    FREE_ARRAY(intPair, chunk->lines, chunk->lineCapacity);
     initChunk(chunk);
 }
 
@@ -34,7 +38,7 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         chunk->lines = GROW_ARRAY(intPair, chunk->lines, oldCapacity, chunk->lineCapacity);
     }
 
-    if(chunk->lineCount < line) {
+    if(chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].first != line) {
         chunk->lines[chunk->lineCount].first = line;
         chunk->lines[chunk->lineCount].second = 1;
         chunk->lineCount++;
@@ -49,7 +53,9 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 // adds a value to the constants array and returns the index of this value
 int addConstant(Chunk* chunk, Value value) {
+    push(value);
     writeValueArray(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 }
 
@@ -66,3 +72,78 @@ void writeConstant(Chunk* chunk, Value value, int line) {
   }
 }
 
+// Drops every byte from count onwards, trimming the line runs to match.
+void truncateChunk(Chunk* chunk, int count) {
+    int remove = chunk->count - count;
+    while(remove > 0) {
+        intPair* run = &chunk->lines[chunk->lineCount - 1];
+        if(run->second <= remove) {
+            remove -= run->second;
+            chunk->lineCount--;
+        } else {
+            run->second -= remove;
+            remove = 0;
+        }
+    }
+    chunk->count = count;
+}
+
+void ownCode(Chunk* chunk) {
+    if(!chunk->readOnly) return;
+    uint8_t* code = ALLOCATE(uint8_t, chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    intPair* lines = ALLOCATE(intPair, chunk->lineCount);
+    memcpy(lines, chunk->lines, sizeof(intPair) * chunk->lineCount);
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->lines = lines;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->readOnly = false;
+}
+
+void remapGlobals(Chunk* chunk, const int* slots, uint32_t count) {
+    ownCode(chunk);
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        uint8_t* code = chunk->code + offset;
+        if(code[0] != OP_DEFINE_GLOBAL && code[0] != OP_GET_GLOBAL && code[0] != OP_SET_GLOBAL) {
+            continue;
+        }
+        uint32_t old = (uint32_t)((code[1] << 8) | code[2]);
+        if(old >= count) continue;
+        int slot = slots[old];
+        code[1] = (uint8_t)(slot >> 8);
+        code[2] = (uint8_t)slot;
+    }
+}
+
+// Size in bytes of an instruction, opcode included.
+int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_CONCAT_N:
+        case OP_CALL:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_INC_LOCAL_CONST:
+        case OP_GET_LOCAL_GET_LOCAL:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return 5;
+        case OP_FOR_NUM_PREP:
+            return 6;
+        case OP_FOR_NUM_LOOP:
+            return 7;
+        default:
+            return 1;
+    }
+}
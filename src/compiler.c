@@ -3,19 +3,11 @@
 #include <string.h>
 #include "common.h"
 #include "compiler.h"
+#include "debug.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
 
 typedef enum {
     PREC_NONE,
@@ -31,181 +23,452 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
-
-typedef struct {
-    ParseFn prefix;
-    ParseFn infix;
-    Precedence precedence;
-} ParseRule;
-
 typedef struct {
     Token name;
     int depth;
 } Local;
 
+// How many trailing literal pushes the constant folder remembers; enough
+// for operands nested this deep, like 1 + (2 + (3 * 4)), to fold fully.
+#define FOLD_DEPTH 8
+
+// A literal push the constant folder may still rewrite: either a
+// constant load (constant is its pool index) or OP_NIL/OP_TRUE/OP_FALSE.
+typedef struct {
+    int start;
+    int end;
+    int constant;
+    Value value;
+} Foldable;
+
 typedef struct {
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+    Foldable foldables[FOLD_DEPTH];
+    int foldableCount;
 } Compiler;
 
-Compiler* current = NULL;
-Parser parser;
-Chunk* compilingChunk;
+// Everything one compile() call works on, so compilations never share
+// state.
+typedef struct {
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    Compiler* compiler;
+    Chunk* chunk;
+} Parser;
+
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
-static void expression();
-static void statement();
-static void declaration();
+typedef struct {
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence precedence;
+} ParseRule;
+
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-static void namedVariable(Token name, bool canAssign);
-static void variable(bool canAssign);
-static uint8_t identifierConstant(Token* token);
-static bool match(TokenType token);
-static void initCompiler(Compiler* compiler);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static void namedVariable(Parser* parser, Token name, bool canAssign);
+static void variable(Parser* parser, bool canAssign);
+static uint16_t identifierSlot(Parser* parser, Token* token);
+static bool match(Parser* parser, TokenType token);
+static void initCompiler(Parser* parser, Compiler* compiler);
 
 
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(Parser* parser, Compiler* compiler) {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->foldableCount = 0;
+    parser->compiler = compiler;
 }
 
-static void errorAt(Token* token, const char* message) {
-    if(parser.panicMode) return;
-    fprintf(stderr, "[Line %d] Error", token->line);
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if(parser->panicMode) return;
+    fprintf(vm->err, "[Line %d] Error", token->line);
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(vm->err, " at end");
     } else if (token->type == TOKEN_ERROR) {
 
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(vm->err, " at '%.*s'", token->length, token->start);
     }
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
-    parser.panicMode = true;
+    fprintf(vm->err, ": %s\n", message);
+    parser->hadError = true;
+    parser->panicMode = true;
 }
 
-static void parserError(const char* message) {
-    errorAt(&parser.current, message);
+static void parserError(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
 }
 
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for(;;) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if(parser->current.type != TOKEN_ERROR) break;
 
-        parserError(parser.current.start);
+        parserError(parser, parser->current.start);
     }
 }
 
 // Checks if the token has the expected type
-static void consume(TokenType type, const char* message) {
-    if(parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if(parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    parserError(message);
+    parserError(parser, message);
 }
 
-static Chunk* currentChunk() {
-    return compilingChunk;
+static Chunk* currentChunk(Parser* parser) {
+    return parser->chunk;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void endCompiler() {
-    emitByte(OP_RETURN);
+static void emitGlobal(Parser* parser, uint8_t instruction, uint16_t slot) {
+    emitByte(parser, instruction);
+    emitByte(parser, (slot >> 8) & 0xff);
+    emitByte(parser, slot & 0xff);
+}
+
+static void endCompiler(Parser* parser) {
+    emitByte(parser, OP_RETURN);
+    if (!parser->hadError) optimizeChunk(currentChunk(parser));
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if (!parser->hadError) {
+        disassembleChunk(currentChunk(parser), "code");
     }
 #endif
 
 }
 
-static void emitConstant(Value value) {
-    writeConstant(currentChunk(), value, parser.previous.line);
+static void recordFoldable(Parser* parser, int start, int constant, Value value) {
+    if(parser->compiler->foldableCount == FOLD_DEPTH) {
+        memmove(&parser->compiler->foldables[0], &parser->compiler->foldables[1], sizeof(Foldable) * (FOLD_DEPTH - 1));
+        parser->compiler->foldableCount--;
+    }
+
+    Foldable* foldable = &parser->compiler->foldables[parser->compiler->foldableCount++];
+    foldable->start = start;
+    foldable->end = currentChunk(parser)->count;
+    foldable->constant = constant;
+    foldable->value = value;
+}
+
+static void emitConstant(Parser* parser, Value value) {
+    int start = currentChunk(parser)->count;
+    writeConstant(currentChunk(parser), value, parser->previous.line);
+    recordFoldable(parser, start, (int)currentChunk(parser)->constants.count - 1, value);
+}
+
+static void emitLiteral(Parser* parser, Value value) {
+    int start = currentChunk(parser)->count;
+    if(IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    } else if(IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(parser, value);
+        return;
+    }
+    recordFoldable(parser, start, -1, value);
+}
+
+// True when the last count instructions emitted are back-to-back literal
+// pushes, i.e. the operands of the operator being compiled.
+static bool canFold(Parser* parser, int count) {
+    if(parser->compiler->foldableCount < count) return false;
+
+    Foldable* last = &parser->compiler->foldables[parser->compiler->foldableCount - 1];
+    if(last->end != currentChunk(parser)->count) return false;
+    if(count == 2 && parser->compiler->foldables[parser->compiler->foldableCount - 2].end != last->start) return false;
+    return true;
+}
+
+// Replaces the last count literal pushes with a single push of result.
+static void replaceFoldables(Parser* parser, int count, Value result) {
+    Chunk* chunk = currentChunk(parser);
+    // The operands' constants are about to go; keep a folded string alive.
+    push(result);
+
+    int start = parser->compiler->foldables[parser->compiler->foldableCount - count].start;
+    for(int i = parser->compiler->foldableCount - 1; i >= parser->compiler->foldableCount - count; i--) {
+        int constant = parser->compiler->foldables[i].constant;
+        if(constant != -1 && constant == (int)chunk->constants.count - 1) {
+            chunk->constants.count--;
+        }
+    }
+    truncateChunk(chunk, start);
+    parser->compiler->foldableCount -= count;
+
+    emitLiteral(parser, result);
+    pop();
+}
+
+// Jump targets split code into pieces that cannot be folded together.
+static void forgetFoldables(Parser* parser) {
+    parser->compiler->foldableCount = 0;
+}
+
+static Value concatenateConstants(Value a, Value b) {
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+
+    ObjString* result = reserveString(left->length + right->length);
+    memcpy(result->chars, left->chars, left->length);
+    memcpy(result->chars + left->length, right->chars, right->length);
+    return OBJ_VAL(internString(result));
+}
+
+// Folds a binary operator over two literal operands exactly as run() would
+// evaluate it. Operand types run() would reject are left for the runtime
+// error.
+static bool foldBinary(Parser* parser, TokenType operatorType) {
+    if(!canFold(parser, 2)) return false;
+
+    Value a = parser->compiler->foldables[parser->compiler->foldableCount - 2].value;
+    Value b = parser->compiler->foldables[parser->compiler->foldableCount - 1].value;
+    bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+    Value result;
+
+    switch (operatorType) {
+        case TOKEN_PLUS:
+            if(numbers) {
+                result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if(IS_STRING(a) && IS_STRING(b)) {
+                result = concatenateConstants(a, b);
+            } else {
+                return false;
+            }
+            break;
+        case TOKEN_MINUS:
+            if(!numbers) return false;
+            result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+            break;
+        case TOKEN_STAR:
+            if(!numbers) return false;
+            result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+            break;
+        case TOKEN_SLASH:
+            if(!numbers) return false;
+            result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+            break;
+        case TOKEN_EQUAL_EQUAL:
+            result = BOOL_VAL(valuesEqual(a, b));
+            break;
+        case TOKEN_BANG_EQUAL:
+            result = BOOL_VAL(!valuesEqual(a, b));
+            break;
+        case TOKEN_GREATER:
+            if(!numbers) return false;
+            result = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+            break;
+        case TOKEN_GREATER_EQUAL:
+            if(!numbers) return false;
+            result = BOOL_VAL(!(AS_NUMBER(a) < AS_NUMBER(b)));
+            break;
+        case TOKEN_LESS:
+            if(!numbers) return false;
+            result = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+            break;
+        case TOKEN_LESS_EQUAL:
+            if(!numbers) return false;
+            result = BOOL_VAL(!(AS_NUMBER(a) > AS_NUMBER(b)));
+            break;
+        default:
+            return false;
+    }
+
+    replaceFoldables(parser, 2, result);
+    return true;
+}
+
+static bool foldUnary(Parser* parser, TokenType operatorType) {
+    if(!canFold(parser, 1)) return false;
+
+    Value operand = parser->compiler->foldables[parser->compiler->foldableCount - 1].value;
+    Value result;
+    switch (operatorType) {
+        case TOKEN_MINUS:
+            if(!IS_NUMBER(operand)) return false;
+            result = NUMBER_VAL(-AS_NUMBER(operand));
+            break;
+        case TOKEN_BANG:
+            result = BOOL_VAL(isFalsey(operand));
+            break;
+        default:
+            return false;
+    }
+
+    replaceFoldables(parser, 1, result);
+    return true;
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
 // for parenthesis stuff and expressions
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' at the end of the expression");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' at the end of the expression");
 }
 
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void call(Parser* parser, bool canAssign) {
+    uint8_t argCount = 0;
+    if(!match(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(parser);
+            if(argCount == UINT8_MAX) error(parser, "Can't have more than 255 arguments");
+            argCount++;
+        } while(match(parser, TOKEN_COMMA));
+        consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after arguments");
+    }
+    emitBytes(parser, OP_CALL, argCount);
+}
+
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
+
+    parsePrecedence(parser, PREC_UNARY);
+    if(foldUnary(parser, operatorType)) return;
 
-    expression();
     switch (operatorType) {
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitByte(parser, OP_NEGATE);
         break;
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitByte(parser, OP_NOT);
         break;
     default: 
         return;
     }
 }
 
-static void binary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+// Adds the count operands on top of the stack, reporting errors at line.
+static void emitAddition(Parser* parser, int count, int line) {
+    if(count == 2) {
+        writeChunk(currentChunk(parser), OP_ADD, line);
+    } else {
+        writeChunk(currentChunk(parser), OP_CONCAT_N, line);
+        writeChunk(currentChunk(parser), (uint8_t)count, line);
+    }
+}
+
+// Adds the count operands below the one whose code starts at operandStart,
+// by lifting that operand's code out and emitting it again after the
+// addition. Its jumps are relative, so they survive the move.
+static void emitAdditionBefore(Parser* parser, int operandStart, int count, int line) {
+    Chunk* chunk = currentChunk(parser);
+    int length = chunk->count - operandStart;
+    uint8_t* code = (uint8_t*)malloc(length);
+    int* lines = (int*)malloc(sizeof(int) * length);
+    if(code == NULL || lines == NULL) exit(1);
+    for(int i = 0; i < length; i++) {
+        code[i] = chunk->code[operandStart + i];
+        lines[i] = getLine(chunk, operandStart + i);
+    }
+    truncateChunk(chunk, operandStart);
+    emitAddition(parser, count, line);
+    for(int i = 0; i < length; i++) writeChunk(chunk, code[i], lines[i]);
+    free(code);
+    free(lines);
+    forgetFoldables(parser);
+}
+
+// a + b + c + ... is compiled as one OP_CONCAT_N over all the operands
+// rather than a chain of OP_ADDs, so no intermediate string is built.
+// Only a prefix of literal operands is folded: folding later literals
+// together would reassociate the additions.
+//
+// An OP_ADD reports errors at the line its right operand ends on, and an
+// OP_CONCAT_N at the line its last operand ends on, so a chain only runs
+// while its operands after the first all end on the same line.
+static void additionChain(Parser* parser) {
+    int count = 1;
+    int line = parser->previous.line;
+    do {
+        int operandStart = currentChunk(parser)->count;
+        parsePrecedence(parser, (Precedence)(PREC_TERM + 1));
+        count++;
+        if(count == 2 && foldBinary(parser, TOKEN_PLUS)) count = 1;
+        if(count > 2 && parser->previous.line != line) {
+            emitAdditionBefore(parser, operandStart, count - 1, line);
+            count = 2;
+        }
+        line = parser->previous.line;
+        if(count == UINT8_MAX) {
+            emitAddition(parser, count, line);
+            count = 1;
+        }
+    } while(match(parser, TOKEN_PLUS));
+
+    if(count >= 2) emitAddition(parser, count, line);
+}
+
+static void binary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
+    if(operatorType == TOKEN_PLUS) {
+        additionChain(parser);
+        return;
+    }
+
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+    if(foldBinary(parser, operatorType)) return;
+
     switch (operatorType) {
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_SLASH: emitByte(parser, OP_DIVIDE); break;
+        case TOKEN_STAR: emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
         default: break;
     }
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
+        case TOKEN_TRUE: emitLiteral(parser, BOOL_VAL(true)); break;
+        case TOKEN_FALSE: emitLiteral(parser, BOOL_VAL(false)); break;
+        case TOKEN_NIL: emitLiteral(parser, NIL_VAL); break;
         default: return;
     }
 }
 
-static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));    
+static void string(Parser* parser, bool canAssign) {
+    emitConstant(parser, OBJ_VAL(copySymbol(parser->previous.start + 1, parser->previous.length - 2)));    
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -213,12 +476,12 @@ static bool identifiersEqual(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     for(int i = compiler->localCount - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if(identifiersEqual(name, &local->name)) {
             if(local->depth == -1) {
-                error("Cannot read local variable in its own initializer");
+                error(parser, "Cannot read local variable in its own initializer");
             }
             return i;
         }
@@ -226,69 +489,71 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if(arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
-    } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        if(canAssign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            emitBytes(parser, OP_SET_LOCAL, (uint8_t)arg);
+        } else {
+            emitBytes(parser, OP_GET_LOCAL, (uint8_t)arg);
+        }
+        return;
     }
 
-    if(canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    uint16_t slot = identifierSlot(parser, &name);
+    if(canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitGlobal(parser, OP_SET_GLOBAL, slot);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitGlobal(parser, OP_GET_GLOBAL, slot);
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+static void patchJump(Parser* parser, int offset) {
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    forgetFoldables(parser);
 }
 
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-    patchJump(endJump);
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+    patchJump(parser, endJump);
 }
 
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 // Parser rules
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+    [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
@@ -300,7 +565,7 @@ ParseRule rules[] = {
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
     [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
-    [TOKEN_BANG_EQUAL]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
@@ -334,245 +599,383 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void parsePrecedence(Precedence precedence) {
+static void parsePrecedence(Parser* parser, Precedence precedence) {
     // implement the precendence order for evaluating expressions;
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if(prefixRule == NULL) {
-        error("Expected an expression");
+        error(parser, "Expected an expression");
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while(precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while(precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
     
-    if(canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target");
+    if(canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target");
     }
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ; after all statements");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ; after all statements");
+    emitByte(parser, OP_PRINT);
 }
 
-static bool check(TokenType token) {
-    return parser.current.type == token;
+static bool check(Parser* parser, TokenType token) {
+    return parser->current.type == token;
 }
 
-static bool match(TokenType token) {
-    if(!check(token)) return false;
-    advance();
+static bool match(Parser* parser, TokenType token) {
+    if(!check(parser, token)) return false;
+    advance(parser);
     return true;
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ; after every expression");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ; after every expression");
+    emitByte(parser, OP_POP);
 }
 
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void endScope() {
-    current->scopeDepth--;
-    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+static void endScope(Parser* parser) {
+    parser->compiler->scopeDepth--;
+    while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+        emitByte(parser, OP_POP);
+        parser->compiler->localCount--;
     }
 }
 
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
-    patchJump(exitJump);
-    emitByte(OP_POP);
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
+    forgetFoldables(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        parserError("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        parserError(parser, "Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
 }
 
 
-static void declareVariable() {
-    if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
-    for(int i = current->localCount-1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if(local->depth != -1 && local->depth < current->scopeDepth) {
+    Token* name = &parser->previous;
+    for(int i = parser->compiler->localCount-1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if(local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
         if (identifiersEqual(name, &local->name)) {
-            error("Variable with this name already declared in this scope.");
+            error(parser, "Variable with this name already declared in this scope.");
         }
     }
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMsg) {
-    printf("Parsing variable, current token: %.*s\n", parser.current.length, parser.current.start);
-    consume(TOKEN_IDENTIFIER, errorMsg);
+static uint16_t parseVariable(Parser* parser, const char* errorMsg) {
+    consume(parser, TOKEN_IDENTIFIER, errorMsg);
 
-    declareVariable();
-    if (current->scopeDepth > 0) return 0;
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierSlot(parser, &parser->previous);
 }
 
-static void markInitialized() {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    if(current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(Parser* parser, uint16_t global) {
+    if(parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global);
+}
+
+
+static void varDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expected a variable name");
+
+    if(match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+    } else {
+        emitByte(parser, OP_NIL);
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(parser, global);
+}
+
+// The loops OP_FOR_NUM_PREP/OP_FOR_NUM_LOOP run:
+//   for (var i = ...; i < bound; i = i + step)
+// where bound is a number literal or an initialized local, read afresh on
+// every trip, and step is a number literal.
+typedef struct {
+    uint8_t counter;
+    uint8_t boundKind;
+    uint8_t bound;
+    uint8_t step;
+    int line;
+} NumericFor;
+
+#define NUMERIC_FOR_TOKENS 12
+
+// Reads an optionally negated number literal starting at tokens[*index].
+static bool numberLiteral(Token* tokens, int count, int* index, double* value) {
+    bool negate = *index < count && tokens[*index].type == TOKEN_MINUS;
+    if(negate) (*index)++;
+    if(*index >= count || tokens[*index].type != TOKEN_NUMBER) return false;
+
+    *value = strtod(tokens[*index].start, NULL);
+    if(negate) *value = -*value;
+    (*index)++;
+    return true;
+}
+
+static bool isToken(Token* tokens, int count, int index, TokenType type) {
+    return index < count && tokens[index].type == type;
 }
 
+static bool isName(Token* tokens, int count, int index, Token* name) {
+    return isToken(tokens, count, index, TOKEN_IDENTIFIER) && identifiersEqual(&tokens[index], name);
+}
+
+// Looks ahead from the condition of a for loop whose initializer just
+// declared counter. On a match the tokens up to and including ')' are
+// consumed and loop is filled in; otherwise nothing is consumed.
+static bool matchNumericFor(Parser* parser, NumericFor* loop) {
+    int counter = parser->compiler->localCount - 1;
+    Token* name = &parser->compiler->locals[counter].name;
+    if(currentChunk(parser)->constants.count + 2 > UINT8_COUNT) return false;
+
+    Token tokens[NUMERIC_FOR_TOKENS];
+    Scanner saved = parser->scanner;
+    int count = 0;
+    tokens[count++] = parser->current;
+    while(count < NUMERIC_FOR_TOKENS && tokens[count - 1].type != TOKEN_RIGHT_PAREN &&
+          tokens[count - 1].type != TOKEN_EOF && tokens[count - 1].type != TOKEN_ERROR) {
+        tokens[count++] = scanToken(&parser->scanner);
+    }
+    parser->scanner = saved;
+
+    int index = 0;
+    if(!isName(tokens, count, index++, name) || !isToken(tokens, count, index++, TOKEN_LESS)) {
+        return false;
+    }
+
+    double bound = 0;
+    int boundLocal = -1;
+    int boundToken = index;
+    if(isToken(tokens, count, index, TOKEN_IDENTIFIER)) {
+        for(int i = parser->compiler->localCount - 1; i >= 0; i--) {
+            if(identifiersEqual(&tokens[index], &parser->compiler->locals[i].name)) {
+                if(parser->compiler->locals[i].depth != -1) boundLocal = i;
+                break;
+            }
+        }
+        if(boundLocal == -1) return false;
+        index++;
+    } else if(!numberLiteral(tokens, count, &index, &bound)) {
+        return false;
+    }
+
+    double step;
+    if(!isToken(tokens, count, index++, TOKEN_SEMICOLON) ||
+       !isName(tokens, count, index++, name) ||
+       !isToken(tokens, count, index++, TOKEN_EQUAL) ||
+       !isName(tokens, count, index++, name) ||
+       !isToken(tokens, count, index++, TOKEN_PLUS) ||
+       !numberLiteral(tokens, count, &index, &step) ||
+       !isToken(tokens, count, index, TOKEN_RIGHT_PAREN)) {
+        return false;
+    }
+    // The condition and the increment report runtime errors from one
+    // instruction, so they must share a line.
+    if(tokens[boundToken].line != tokens[index].line) return false;
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expected a variable name");
+    for(int i = 0; i <= index; i++) advance(parser);
 
-    if(match(TOKEN_EQUAL)) {
-        expression();
+    loop->counter = (uint8_t)counter;
+    if(boundLocal != -1) {
+        loop->boundKind = FOR_BOUND_LOCAL;
+        loop->bound = (uint8_t)boundLocal;
     } else {
-        emitByte(OP_NIL);
+        loop->boundKind = FOR_BOUND_CONSTANT;
+        loop->bound = (uint8_t)addConstant(currentChunk(parser), NUMBER_VAL(bound));
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    loop->step = (uint8_t)addConstant(currentChunk(parser), NUMBER_VAL(step));
+    loop->line = tokens[index].line;
+    return true;
+}
 
-    defineVariable(global);
+static void numericForLoop(Parser* parser, NumericFor* loop) {
+    Chunk* chunk = currentChunk(parser);
+    writeChunk(chunk, OP_FOR_NUM_PREP, loop->line);
+    writeChunk(chunk, loop->counter, loop->line);
+    writeChunk(chunk, loop->boundKind, loop->line);
+    writeChunk(chunk, loop->bound, loop->line);
+    writeChunk(chunk, 0xff, loop->line);
+    writeChunk(chunk, 0xff, loop->line);
+    int exitJump = chunk->count - 2;
+
+    int bodyStart = chunk->count;
+    forgetFoldables(parser);
+    statement(parser);
+
+    writeChunk(chunk, OP_FOR_NUM_LOOP, loop->line);
+    writeChunk(chunk, loop->counter, loop->line);
+    writeChunk(chunk, loop->boundKind, loop->line);
+    writeChunk(chunk, loop->bound, loop->line);
+    writeChunk(chunk, loop->step, loop->line);
+    int offset = chunk->count - bodyStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+    writeChunk(chunk, (offset >> 8) & 0xff, loop->line);
+    writeChunk(chunk, offset & 0xff, loop->line);
+
+    patchJump(parser, exitJump);
 }
 
-static void forStatement() {
-    beginScope();
+static void forStatement(Parser* parser) {
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
 
-    if (match(TOKEN_SEMICOLON)) {
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+        NumericFor loop;
+        if (parser->compiler->scopeDepth > 0 && !parser->hadError && matchNumericFor(parser, &loop)) {
+            numericForLoop(parser, &loop);
+            endScope(parser);
+            return;
+        }
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
+    forgetFoldables(parser);
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); 
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP); 
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        forgetFoldables(parser);
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
-    }
-
-    endScope();
-}
-
-static void statement() {
-    if(match(TOKEN_PRINT)) {
-        printStatement();
-    } else if(match(TOKEN_IF)) {
-        ifStatement();
-    } else if(match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if(match(TOKEN_FOR)) {
-        forStatement();
-    } else if(match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP); // Condition.
+    }
+
+    endScope(parser);
+}
+
+static void statement(Parser* parser) {
+    if(match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if(match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if(match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if(match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if(match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-static void synchronize() {
-    parser.panicMode = false;
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -587,48 +990,56 @@ static void synchronize() {
             ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
-        parserError("Too many constants in one chunk");
+static uint16_t identifierSlot(Parser* parser, Token* token) {
+    int slot = globalSlot(copySymbol(token->start, token->length));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return (uint16_t)slot;
 }
 
-static uint8_t identifierConstant(Token* token) {
-    return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
-}
 
-
-static void declaration() {
-    if(match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if(match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if(parser.panicMode) synchronize();
+    if(parser->panicMode) synchronize(parser);
 }
 
 bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+    Parser parser;
+    initScanner(&parser.scanner, source);
     Compiler compiler;
-    initCompiler(&compiler);
+    initCompiler(&parser, &compiler);
     parser.hadError = false;
     parser.panicMode = false;
-    compilingChunk = chunk;
-    advance();
+    parser.chunk = chunk;
+    vm->compilingChunk = chunk;
+    advance(&parser);
     
-    while(!match(TOKEN_EOF)) {
-        declaration();
+    while(!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    endCompiler();
+    endCompiler(&parser);
+    vm->compilingChunk = NULL;
     return !parser.hadError;
-}
\ No newline at end of file
+}
+
+void markCompilerRoots() {
+    if(vm->compilingChunk == NULL) return;
+
+    ValueArray* constants = &vm->compilingChunk->constants;
+    for(uint32_t i = 0; i < constants->count; i++) {
+        markValue(constants->values[i]);
+    }
+}
@@ -4,6 +4,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("==========%s==========\n", name);
@@ -43,6 +44,65 @@ static int byteInstruction(const char* OpCode, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(const char* OpCode, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", OpCode, slot);
+    if (slot < vm->globalNames.count) printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static const char* opcodeNames[] = {
+    [OP_CONSTANT]      = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NEGATE]        = "OP_NEGATE",
+    [OP_ADD]           = "OP_ADD",
+    [OP_SUBTRACT]      = "OP_SUBTRACT",
+    [OP_MULTIPLY]      = "OP_MULTIPLY",
+    [OP_DIVIDE]        = "OP_DIVIDE",
+    [OP_RETURN]        = "OP_RETURN",
+    [OP_NIL]           = "OP_NIL",
+    [OP_TRUE]          = "OP_TRUE",
+    [OP_FALSE]         = "OP_FALSE",
+    [OP_PRINT]         = "OP_PRINT",
+    [OP_NOT]           = "OP_NOT",
+    [OP_EQUAL]         = "OP_EQUAL",
+    [OP_GREATER]       = "OP_GREATER",
+    [OP_LESS]          = "OP_LESS",
+    [OP_POP]           = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL]    = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL]    = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL]     = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]     = "OP_SET_LOCAL",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP]          = "OP_JUMP",
+    [OP_LOOP]          = "OP_LOOP",
+    [OP_NOT_EQUAL]     = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL]    = "OP_LESS_EQUAL",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_INC_LOCAL_CONST] = "OP_INC_LOCAL_CONST",
+    [OP_LESS_LOCAL_CONST_JUMP] = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_FOR_NUM_PREP]  = "OP_FOR_NUM_PREP",
+    [OP_FOR_NUM_LOOP]  = "OP_FOR_NUM_LOOP",
+    [OP_CONCAT_N]      = "OP_CONCAT_N",
+    [OP_CALL]          = "OP_CALL",
+    [OP_GET_LOCAL_GET_LOCAL] = "OP_GET_LOCAL_GET_LOCAL",
+    [OP_ADD_NUM]       = "OP_ADD_NUM",
+    [OP_ADD_STR]       = "OP_ADD_STR",
+    [OP_EQUAL_NUM]     = "OP_EQUAL_NUM",
+    [OP_GREATER_NUM]   = "OP_GREATER_NUM",
+    [OP_LESS_NUM]      = "OP_LESS_NUM",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if(instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
 int getLine(Chunk* chunk, int offset) {
     
     int index = 0;
@@ -57,6 +117,34 @@ int getLine(Chunk* chunk, int offset) {
     exit(1);
 }
 
+// A local slot followed by a one-byte constant index.
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int forNumInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    int length = instructionLength(code[0]);
+    printf("%-16s %4d < ", name, code[1]);
+    if(code[2] == FOR_BOUND_LOCAL) {
+        printf("local %d", code[3]);
+    } else {
+        printValue(chunk->constants.values[code[3]]);
+    }
+    if(code[0] == OP_FOR_NUM_LOOP) {
+        printf(" step ");
+        printValue(chunk->constants.values[code[4]]);
+    }
+    uint16_t jump = (uint16_t)(code[length - 2] << 8) | code[length - 1];
+    printf(" %4d -> %d\n", offset, offset + length + sign * jump);
+    return offset + length;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -104,11 +192,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -121,6 +209,44 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_INC_LOCAL_CONST:
+            return localConstantInstruction("OP_INC_LOCAL_CONST", chunk, offset);
+        case OP_FOR_NUM_PREP:
+            return forNumInstruction("OP_FOR_NUM_PREP", 1, chunk, offset);
+        case OP_FOR_NUM_LOOP:
+            return forNumInstruction("OP_FOR_NUM_LOOP", -1, chunk, offset);
+        case OP_CONCAT_N:
+            return byteInstruction("OP_CONCAT_N", chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+            jump |= chunk->code[offset + 4];
+            printf("%-16s %4d %4d -> %d\n", "OP_LESS_LOCAL_CONST_JUMP", chunk->code[offset + 1],
+                   chunk->code[offset + 2], offset + 5 + jump);
+            return offset + 5;
+        }
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GET_LOCAL_GET_LOCAL:
+            printf("%-16s %4d %4d\n", "OP_GET_LOCAL_GET_LOCAL", chunk->code[offset + 1], chunk->code[offset + 2]);
+            return offset + 3;
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,1178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+bool jitEnabled = false;
+bool traceJitEnabled = false;
+
+#ifndef JIT
+
+bool jitRun(Chunk* chunk, InterpretResult* result) {
+    (void)chunk;
+    (void)result;
+    return false;
+}
+
+#else
+
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "object.h"
+
+// Generated code is a single function, Value* code(Value* sp), that
+// returns the final stack top or NULL after a runtime error. It keeps:
+//   rbx  the stack top, exactly like sp in run()
+//   r12  vm->stack, the base of the local slots
+//   r13  QNAN, for number checks
+//   r14  vm->globalValues.values
+// Each opcode is a fixed template; anything that is not plain number
+// arithmetic or a stack shuffle calls one of the jit* helpers below.
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// Condition codes, as the low nibble of Jcc (0f 8x) and SETcc (0f 9x).
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_NP 0xb
+
+// Jump targets that are not bytecode offsets.
+#define TARGET_EXIT  -1
+#define TARGET_ERROR -2
+
+typedef struct {
+    int at;      // offset of the rel32 to fill in
+    int target;  // bytecode offset, TARGET_EXIT or TARGET_ERROR
+} Patch;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+} Assembler;
+
+// The assembler's buffers are scratch space, so like the gray stack they
+// bypass reallocate().
+static void emitBytes(Assembler* as, const uint8_t* bytes, int count) {
+    if(as->capacity < as->count + count) {
+        while(as->capacity < as->count + count) as->capacity = GROW_CAPACITY(as->capacity);
+        as->code = (uint8_t*)realloc(as->code, as->capacity);
+        if(as->code == NULL) exit(1);
+    }
+    memcpy(as->code + as->count, bytes, count);
+    as->count += count;
+}
+
+#define EMIT(as, ...) \
+    emitBytes(as, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler* as, uint32_t value) {
+    EMIT(as, value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    emit32(as, (uint32_t)value);
+    emit32(as, (uint32_t)(value >> 32));
+}
+
+static uint8_t rex(int reg, int rm) {
+    return 0x48 | (reg >= R8 ? 4 : 0) | (rm >= R8 ? 1 : 0);
+}
+
+// op r/m64, r64 between two registers: mov (89), add (01), and (21),
+// cmp (39), test (85), xor (31).
+static void emitRegReg(Assembler* as, uint8_t op, Register rm, Register reg) {
+    EMIT(as, rex(reg, rm), op, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op between a register and [base + disp32]: load (8b) or store (89).
+static void emitMemory(Assembler* as, uint8_t op, Register reg, Register base, int disp) {
+    EMIT(as, rex(reg, base), op, 0x80 | (reg & 7) << 3 | (base & 7));
+    if((base & 7) == RSP) EMIT(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+static void emitLoad(Assembler* as, Register reg, Register base, int disp) {
+    emitMemory(as, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Assembler* as, Register base, int disp, Register reg) {
+    emitMemory(as, 0x89, reg, base, disp);
+}
+
+static void emitMovImm(Assembler* as, Register reg, uint64_t value) {
+    EMIT(as, reg >= R8 ? 0x49 : 0x48, 0xb8 + (reg & 7));
+    emit64(as, value);
+}
+
+// Moves rbx, the stack top, by a whole number of slots.
+static void emitAdjustStack(Assembler* as, int slots) {
+    if(slots > 0) EMIT(as, 0x48, 0x83, 0xc3, (uint8_t)(slots * sizeof(Value)));
+    if(slots < 0) EMIT(as, 0x48, 0x83, 0xeb, (uint8_t)(-slots * sizeof(Value)));
+}
+
+// Emits a jump with a zero rel32 and returns where the rel32 is.
+static int emitJump(Assembler* as) {
+    EMIT(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static int emitJumpIf(Assembler* as, uint8_t cc) {
+    EMIT(as, 0x0f, 0x80 | cc);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void patchTo(Assembler* as, int at, int to) {
+    uint32_t rel = (uint32_t)(to - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+static void bindHere(Assembler* as, int at) {
+    patchTo(as, at, as->count);
+}
+
+static void addPatch(Assembler* as, int at, int target) {
+    if(as->patchCapacity < as->patchCount + 1) {
+        as->patchCapacity = GROW_CAPACITY(as->patchCapacity);
+        as->patches = (Patch*)realloc(as->patches, sizeof(Patch) * as->patchCapacity);
+        if(as->patches == NULL) exit(1);
+    }
+    as->patches[as->patchCount].at = at;
+    as->patches[as->patchCount].target = target;
+    as->patchCount++;
+}
+
+// Jumps to the returned rel32 when reg does not hold a number.
+static int emitNotNumber(Assembler* as, Register reg) {
+    emitRegReg(as, 0x89, RDX, reg);
+    emitRegReg(as, 0x21, RDX, R13);
+    emitRegReg(as, 0x39, RDX, R13);
+    return emitJumpIf(as, CC_E);
+}
+
+// Calls helper(sp, next[, arg]) and takes its result as the new stack
+// top, leaving through the error exit when it returns NULL. next is the
+// bytecode offset after the instruction, which is what vm->ip would hold.
+static void emitCall(Assembler* as, void* helper, int next, int arg) {
+    emitRegReg(as, 0x89, RDI, RBX);
+    EMIT(as, 0xbe);
+    emit32(as, (uint32_t)next);
+    EMIT(as, 0xba);
+    emit32(as, (uint32_t)arg);
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)helper);
+    EMIT(as, 0xff, 0xd0);
+    emitRegReg(as, 0x85, RAX, RAX);
+    addPatch(as, emitJumpIf(as, CC_E), TARGET_ERROR);
+    emitRegReg(as, 0x89, RBX, RAX);
+}
+
+static void emitToXmm(Assembler* as, int xmm, Register reg) {
+    EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0 | xmm << 3 | reg);
+}
+
+// Turns the flags into TRUE_VAL or FALSE_VAL in rax.
+static void emitBoolFromFlags(Assembler* as, uint8_t cc, bool negate) {
+    EMIT(as, 0x0f, 0x90 | cc, 0xc0);
+    if(negate) EMIT(as, 0x34, 0x01);
+    EMIT(as, 0x0f, 0xb6, 0xc0);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRegReg(as, 0x01, RAX, RCX);
+}
+
+// Loads the two operands into rax and rcx, and xmm0 and xmm1, and jumps to
+// the returned rel32s when either is not a number.
+static void emitNumberOperands(Assembler* as, int* notNumber) {
+    emitLoad(as, RAX, RBX, -2 * (int)sizeof(Value));
+    emitLoad(as, RCX, RBX, -1 * (int)sizeof(Value));
+    notNumber[0] = emitNotNumber(as, RAX);
+    notNumber[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+}
+
+// Leaves through the returned rel32s when rax is falsey: nil, false, or
+// a zero of either sign.
+static void emitFalseyJumps(Assembler* as, int* falsey) {
+    emitMovImm(as, RCX, NIL_VAL);
+    emitRegReg(as, 0x39, RAX, RCX);
+    falsey[0] = emitJumpIf(as, CC_E);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRegReg(as, 0x39, RAX, RCX);
+    falsey[1] = emitJumpIf(as, CC_E);
+    int truthy = emitNotNumber(as, RAX);
+    emitRegReg(as, 0x89, RDX, RAX);
+    emitRegReg(as, 0x01, RDX, RDX);
+    falsey[2] = emitJumpIf(as, CC_E);
+    bindHere(as, truthy);
+}
+
+static Value* jitAdd(Value* sp, int next) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    if(IS_TEXT(sp[-1]) && IS_TEXT(sp[-2])) {
+        Value result;
+        if(!concatenate(sp[-2], sp[-1], &result)) return NULL;
+        sp[-2] = result;
+        return sp - 1;
+    }
+    if(IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {
+        sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) + AS_NUMBER(sp[-1]));
+        return sp - 1;
+    }
+    runtimeError("Operands must be two numbers or two strings");
+    return NULL;
+}
+
+static Value* jitAddMany(Value* sp, int next, int count) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    Value result;
+    if(!addMany(sp - count, count, &result)) return NULL;
+    sp[-count] = result;
+    return sp - count + 1;
+}
+
+static Value* jitCall(Value* sp, int next, int argCount) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    Value result;
+    if(!callValue(sp[-1 - argCount], sp - argCount, argCount, &result)) return NULL;
+    sp[-1 - argCount] = result;
+    return sp - argCount;
+}
+
+static Value* jitOperandsError(Value* sp, int next) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    runtimeError("Operands must be numbers");
+    return NULL;
+}
+
+static Value* jitOperandError(Value* sp, int next) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    runtimeError("Operand must be a number");
+    return NULL;
+}
+
+static Value* jitUndefinedVariable(Value* sp, int next, int slot) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    runtimeError("Undefined variable '%s'", AS_CSTRING(vm->globalNames.values[slot]));
+    return NULL;
+}
+
+// The counter or the bound of an OP_FOR_NUM_LOOP is not a number.
+static Value* jitForLoopError(Value* sp, int next, int slot) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    if(IS_NUMBER(vm->stack[slot])) {
+        runtimeError("Operands must be numbers");
+    } else {
+        runtimeError("Operands must be two numbers or two strings");
+    }
+    return NULL;
+}
+
+// Two different objects, which are still equal when they spell the same
+// text through a rope.
+static Value* jitEqual(Value* sp, int next, int negate) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    bool equal = valuesEqual(sp[-2], sp[-1]);
+    sp[-2] = BOOL_VAL(equal != (bool)negate);
+    return sp - 1;
+}
+
+static Value* jitSafepoint(Value* sp, int next) {
+    vm->sp = sp;
+    vm->ip = vm->chunk->code + next;
+    collectYoung();
+    return sp;
+}
+
+static Value* jitGlobalBarrier(Value* sp, int next, int slot) {
+    (void)next;
+    markValue(vm->globalValues.values[slot]);
+    return sp;
+}
+
+static Value* jitPrint(Value* sp, int next) {
+    (void)next;
+    printValue(sp[-1]);
+    fputc('\n', vm->out);
+    return sp - 1;
+}
+
+// The *Fast emitters below cover operands that are numbers and leave the
+// other case to the caller through the notNumber rel32s.
+static void emitArithmeticFast(Assembler* as, uint8_t sseOp, int* notNumber) {
+    emitNumberOperands(as, notNumber);
+    EMIT(as, 0xf2, 0x0f, sseOp, 0xc1);
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);
+    emitStore(as, RBX, -2 * (int)sizeof(Value), RAX);
+    emitAdjustStack(as, -1);
+}
+
+static void emitArithmetic(Assembler* as, uint8_t sseOp, void* slowPath, int next) {
+    int notNumber[2];
+    emitArithmeticFast(as, sseOp, notNumber);
+    int done = emitJump(as);
+    bindHere(as, notNumber[0]);
+    bindHere(as, notNumber[1]);
+    emitCall(as, slowPath, next, 0);
+    bindHere(as, done);
+}
+
+// a < b is ucomisd b, a then "above"; negate gives the !(a < b) that
+// OP_GREATER_EQUAL stands for, which is false for NaN like the original.
+static void emitComparisonFast(Assembler* as, bool less, bool negate, int* notNumber) {
+    emitNumberOperands(as, notNumber);
+    if(less) {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);
+    } else {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);
+    }
+    emitBoolFromFlags(as, CC_A, negate);
+    emitStore(as, RBX, -2 * (int)sizeof(Value), RAX);
+    emitAdjustStack(as, -1);
+}
+
+static void emitComparison(Assembler* as, bool less, bool negate, int next) {
+    int notNumber[2];
+    emitComparisonFast(as, less, negate, notNumber);
+    int done = emitJump(as);
+    bindHere(as, notNumber[0]);
+    bindHere(as, notNumber[1]);
+    emitCall(as, jitOperandsError, next, 0);
+    bindHere(as, done);
+}
+
+// Numbers compare as doubles, so NaN != NaN; anything else by its bits,
+// except that two different objects go to jitEqual in case one is a rope.
+static void emitEquality(Assembler* as, bool negate, int next) {
+    emitLoad(as, RAX, RBX, -2 * (int)sizeof(Value));
+    emitLoad(as, RCX, RBX, -1 * (int)sizeof(Value));
+    int bits[2];
+    bits[0] = emitNotNumber(as, RAX);
+    bits[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);
+    EMIT(as, 0x0f, 0x94, 0xc0);         // sete al
+    EMIT(as, 0x0f, 0x9b, 0xc1);         // setnp cl
+    EMIT(as, 0x20, 0xc8);               // and al, cl
+    int join = emitJump(as);
+    bindHere(as, bits[0]);
+    bindHere(as, bits[1]);
+    emitRegReg(as, 0x39, RAX, RCX);
+    EMIT(as, 0x0f, 0x94, 0xc0);
+    int same = emitJumpIf(as, CC_E);
+    emitRegReg(as, 0x89, RDX, RAX);
+    emitRegReg(as, 0x21, RDX, RCX);
+    emitMovImm(as, RSI, QNAN | SIGN_BIT);
+    emitRegReg(as, 0x21, RDX, RSI);
+    emitRegReg(as, 0x39, RDX, RSI);
+    int notObjects = emitJumpIf(as, CC_NE);
+    emitCall(as, jitEqual, next, negate);
+    int done = emitJump(as);
+    bindHere(as, join);
+    bindHere(as, same);
+    bindHere(as, notObjects);
+    if(negate) EMIT(as, 0x34, 0x01);
+    EMIT(as, 0x0f, 0xb6, 0xc0);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRegReg(as, 0x01, RAX, RCX);
+    emitStore(as, RBX, -2 * (int)sizeof(Value), RAX);
+    emitAdjustStack(as, -1);
+    bindHere(as, done);
+}
+
+static void emitPush(Assembler* as, Register reg) {
+    emitStore(as, RBX, 0, reg);
+    emitAdjustStack(as, 1);
+}
+
+static void emitPushConstant(Assembler* as, Value value) {
+    emitMovImm(as, RAX, value);
+    emitPush(as, RAX);
+}
+
+static int localDisp(int slot) {
+    return slot * (int)sizeof(Value);
+}
+
+// Local slot plus constant, for OP_INC_LOCAL_CONST. rax and rcx still
+// hold the operands when a notNumber jump is taken.
+static void emitIncLocalFast(Assembler* as, int slot, Value constant, int* notNumber) {
+    emitLoad(as, RAX, R12, localDisp(slot));
+    emitMovImm(as, RCX, constant);
+    notNumber[0] = emitNotNumber(as, RAX);
+    notNumber[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    EMIT(as, 0xf2, 0x0f, 0x58, 0xc1);
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);
+    emitStore(as, R12, localDisp(slot), RAX);
+}
+
+// Compares a local slot with a constant for OP_LESS_LOCAL_CONST_JUMP,
+// leaving "above" set exactly when local < constant.
+static void emitLessLocalFast(Assembler* as, int slot, Value constant, int* notNumber) {
+    emitLoad(as, RAX, R12, localDisp(slot));
+    emitMovImm(as, RCX, constant);
+    notNumber[0] = emitNotNumber(as, RAX);
+    notNumber[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);
+}
+
+// Loads the bound of an OP_FOR_NUM_* instruction into rcx.
+static void emitForBound(Assembler* as, Chunk* chunk, uint8_t* code) {
+    if(code[2] == FOR_BOUND_LOCAL) {
+        emitLoad(as, RCX, R12, localDisp(code[3]));
+    } else {
+        emitMovImm(as, RCX, chunk->constants.values[code[3]]);
+    }
+}
+
+// OP_FOR_NUM_PREP: leaves "above" set exactly when counter < bound.
+static void emitForPrepFast(Assembler* as, Chunk* chunk, uint8_t* code, int* notNumber) {
+    emitLoad(as, RAX, R12, localDisp(code[1]));
+    emitForBound(as, chunk, code);
+    notNumber[0] = emitNotNumber(as, RAX);
+    notNumber[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);
+}
+
+// OP_FOR_NUM_LOOP: steps the counter and leaves "above" set exactly when
+// the new value is below the bound. The counter is only written once both
+// checks have passed, so a notNumber jump leaves everything untouched.
+static void emitForLoopFast(Assembler* as, Chunk* chunk, uint8_t* code, int* notNumber) {
+    emitLoad(as, RAX, R12, localDisp(code[1]));
+    emitForBound(as, chunk, code);
+    notNumber[0] = emitNotNumber(as, RAX);
+    notNumber[1] = emitNotNumber(as, RCX);
+    emitToXmm(as, 1, RCX);
+    emitToXmm(as, 0, RAX);
+    emitMovImm(as, RAX, chunk->constants.values[code[4]]);
+    emitToXmm(as, 2, RAX);
+    EMIT(as, 0xf2, 0x0f, 0x58, 0xc2);                 // addsd xmm0, xmm2
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);           // movq rax, xmm0
+    emitStore(as, R12, localDisp(code[1]), RAX);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);                 // ucomisd xmm1, xmm0
+}
+
+// Back-edges are safepoints: the nursery is emptied there once full. The
+// templates reload every value from its slot, so moved objects are seen.
+static void emitSafepoint(Assembler* as, int next) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm->nurseryFull);
+    EMIT(as, 0x80, 0x38, 0x00);                       // cmp byte [rax], 0
+    int clear = emitJumpIf(as, CC_E);
+    emitCall(as, jitSafepoint, next, 0);
+    bindHere(as, clear);
+}
+
+// Store barrier for an incremental collection that is marking.
+static void emitGlobalBarrier(Assembler* as, int next, int slot) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm->gcMarking);
+    EMIT(as, 0x80, 0x38, 0x00);                       // cmp byte [rax], 0
+    int clear = emitJumpIf(as, CC_E);
+    emitCall(as, jitGlobalBarrier, next, slot);
+    bindHere(as, clear);
+}
+
+static int jumpOffset(uint8_t* code) {
+    int length = instructionLength(code[0]);
+    return (code[length - 2] << 8) | code[length - 1];
+}
+
+// Returns false on an opcode there is no template for.
+static bool emitInstruction(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+    int next = offset + instructionLength(code[0]);
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            emitPushConstant(as, constants[code[1]]);
+            return true;
+        case OP_CONSTANT_LONG:
+            emitPushConstant(as, constants[code[1] | (code[2] << 8) | (code[3] << 16)]);
+            return true;
+        case OP_NIL:   emitPushConstant(as, NIL_VAL); return true;
+        case OP_TRUE:  emitPushConstant(as, TRUE_VAL); return true;
+        case OP_FALSE: emitPushConstant(as, FALSE_VAL); return true;
+        case OP_POP:
+            emitAdjustStack(as, -1);
+            return true;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:      emitArithmetic(as, 0x58, jitAdd, next); return true;
+        case OP_CONCAT_N:     emitCall(as, jitAddMany, next, code[1]); return true;
+        case OP_CALL:         emitCall(as, jitCall, next, code[1]); return true;
+        case OP_SUBTRACT:     emitArithmetic(as, 0x5c, jitOperandsError, next); return true;
+        case OP_MULTIPLY:     emitArithmetic(as, 0x59, jitOperandsError, next); return true;
+        case OP_DIVIDE:       emitArithmetic(as, 0x5e, jitOperandsError, next); return true;
+        case OP_LESS:
+        case OP_LESS_NUM:     emitComparison(as, true, false, next); return true;
+        case OP_GREATER:
+        case OP_GREATER_NUM:  emitComparison(as, false, false, next); return true;
+        case OP_GREATER_EQUAL: emitComparison(as, true, true, next); return true;
+        case OP_LESS_EQUAL:   emitComparison(as, false, true, next); return true;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:    emitEquality(as, false, next); return true;
+        case OP_NOT_EQUAL:    emitEquality(as, true, next); return true;
+
+        case OP_NEGATE: {
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            int notNumber = emitNotNumber(as, RAX);
+            EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f);     // btc rax, 63
+            emitStore(as, RBX, -(int)sizeof(Value), RAX);
+            int done = emitJump(as);
+            bindHere(as, notNumber);
+            emitCall(as, jitOperandError, next, 0);
+            bindHere(as, done);
+            return true;
+        }
+
+        case OP_NOT: {
+            int falsey[3];
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            emitFalseyJumps(as, falsey);
+            emitMovImm(as, RAX, FALSE_VAL);
+            int store = emitJump(as);
+            for(int i = 0; i < 3; i++) bindHere(as, falsey[i]);
+            emitMovImm(as, RAX, TRUE_VAL);
+            bindHere(as, store);
+            emitStore(as, RBX, -(int)sizeof(Value), RAX);
+            return true;
+        }
+
+        case OP_PRINT:
+            emitCall(as, jitPrint, next, 0);
+            return true;
+
+        case OP_GET_LOCAL:
+            emitLoad(as, RAX, R12, localDisp(code[1]));
+            emitPush(as, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            emitStore(as, R12, localDisp(code[1]), RAX);
+            return true;
+        case OP_SET_LOCAL_POP:
+            emitAdjustStack(as, -1);
+            emitLoad(as, RAX, RBX, 0);
+            emitStore(as, R12, localDisp(code[1]), RAX);
+            return true;
+        case OP_GET_LOCAL_GET_LOCAL:
+            emitLoad(as, RAX, R12, localDisp(code[1]));
+            emitLoad(as, RCX, R12, localDisp(code[2]));
+            emitStore(as, RBX, 0, RAX);
+            emitStore(as, RBX, (int)sizeof(Value), RCX);
+            emitAdjustStack(as, 2);
+            return true;
+
+        case OP_DEFINE_GLOBAL: {
+            int slot = (code[1] << 8) | code[2];
+            emitAdjustStack(as, -1);
+            emitLoad(as, RAX, RBX, 0);
+            emitStore(as, R14, localDisp(slot), RAX);
+            emitGlobalBarrier(as, next, slot);
+            return true;
+        }
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int slot = (code[1] << 8) | code[2];
+            emitLoad(as, RAX, R14, localDisp(slot));
+            emitMovImm(as, RCX, UNDEFINED_VAL);
+            emitRegReg(as, 0x39, RAX, RCX);
+            int defined = emitJumpIf(as, CC_NE);
+            emitCall(as, jitUndefinedVariable, next, slot);
+            bindHere(as, defined);
+            if(code[0] == OP_GET_GLOBAL) {
+                emitPush(as, RAX);
+            } else {
+                emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+                emitStore(as, R14, localDisp(slot), RAX);
+                emitGlobalBarrier(as, next, slot);
+            }
+            return true;
+        }
+
+        case OP_INC_LOCAL_CONST: {
+            int notNumber[2];
+            emitIncLocalFast(as, code[1], constants[code[2]], notNumber);
+            int done = emitJump(as);
+            // Strings and errors go the long way round, through the stack.
+            bindHere(as, notNumber[0]);
+            bindHere(as, notNumber[1]);
+            emitStore(as, RBX, 0, RAX);
+            emitStore(as, RBX, (int)sizeof(Value), RCX);
+            emitAdjustStack(as, 2);
+            emitCall(as, jitAdd, next, 0);
+            emitAdjustStack(as, -1);
+            emitLoad(as, RAX, RBX, 0);
+            emitStore(as, R12, localDisp(code[1]), RAX);
+            bindHere(as, done);
+            return true;
+        }
+
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            int target = next + ((code[3] << 8) | code[4]);
+            int notNumber[2];
+            emitLessLocalFast(as, code[1], constants[code[2]], notNumber);
+            addPatch(as, emitJumpIf(as, CC_BE), target);
+            int done = emitJump(as);
+            bindHere(as, notNumber[0]);
+            bindHere(as, notNumber[1]);
+            emitCall(as, jitOperandsError, next, 0);
+            bindHere(as, done);
+            return true;
+        }
+
+        // Type errors go back through the interpreter's checks, in its order.
+        case OP_FOR_NUM_PREP: {
+            int notNumber[2];
+            emitForPrepFast(as, chunk, code, notNumber);
+            addPatch(as, emitJumpIf(as, CC_BE), next + jumpOffset(code));
+            int done = emitJump(as);
+            bindHere(as, notNumber[0]);
+            bindHere(as, notNumber[1]);
+            emitCall(as, jitOperandsError, next, 0);
+            bindHere(as, done);
+            return true;
+        }
+        case OP_FOR_NUM_LOOP: {
+            int notNumber[2];
+            emitSafepoint(as, next);
+            emitForLoopFast(as, chunk, code, notNumber);
+            addPatch(as, emitJumpIf(as, CC_A), next - jumpOffset(code));
+            int done = emitJump(as);
+            bindHere(as, notNumber[0]);
+            bindHere(as, notNumber[1]);
+            emitCall(as, jitForLoopError, next, code[1]);
+            bindHere(as, done);
+            return true;
+        }
+
+        case OP_JUMP:
+            addPatch(as, emitJump(as), next + ((code[1] << 8) | code[2]));
+            return true;
+        case OP_LOOP:
+            emitSafepoint(as, next);
+            addPatch(as, emitJump(as), next - ((code[1] << 8) | code[2]));
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            int target = next + ((code[1] << 8) | code[2]);
+            int falsey[3];
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            emitFalseyJumps(as, falsey);
+            for(int i = 0; i < 3; i++) addPatch(as, falsey[i], target);
+            return true;
+        }
+
+        case OP_RETURN:
+            addPatch(as, emitJump(as), TARGET_EXIT);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Four pushes and eight bytes keep calls 16-byte aligned.
+static void emitPrologue(Assembler* as) {
+    EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+    EMIT(as, 0x48, 0x83, 0xec, 0x08);
+    emitRegReg(as, 0x89, RBX, RDI);
+    emitMovImm(as, R12, (uint64_t)(uintptr_t)vm->stack);
+    emitMovImm(as, R13, QNAN);
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm->globalValues.values);
+    emitLoad(as, R14, RAX, 0);
+}
+
+// Emits the shared exit, which returns rbx, and the error exit, which
+// returns NULL.
+static void emitEpilogue(Assembler* as, int* exitLabel, int* errorLabel) {
+    *exitLabel = as->count;
+    emitRegReg(as, 0x89, RAX, RBX);
+    EMIT(as, 0x48, 0x83, 0xc4, 0x08);
+    EMIT(as, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+    *errorLabel = as->count;
+    emitRegReg(as, 0x31, RBX, RBX);
+    patchTo(as, emitJump(as), *exitLabel);
+}
+
+static bool translate(Assembler* as, Chunk* chunk) {
+    emitPrologue(as);
+
+    int* nativeOffset = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    if(nativeOffset == NULL) exit(1);
+
+    bool supported = true;
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        nativeOffset[offset] = as->count;
+        if(!emitInstruction(as, chunk, offset)) {
+            supported = false;
+            break;
+        }
+    }
+    nativeOffset[chunk->count] = as->count;
+
+    // Falling off the end behaves like OP_RETURN.
+    int exitLabel, errorLabel;
+    emitEpilogue(as, &exitLabel, &errorLabel);
+
+    for(int i = 0; supported && i < as->patchCount; i++) {
+        Patch* patch = &as->patches[i];
+        int to = patch->target == TARGET_EXIT ? exitLabel
+               : patch->target == TARGET_ERROR ? errorLabel
+               : nativeOffset[patch->target];
+        patchTo(as, patch->at, to);
+    }
+
+    free(nativeOffset);
+    return supported;
+}
+
+// Copies the assembled code into fresh executable memory and frees the
+// assembler. Returns NULL if the memory cannot be had.
+static void* install(Assembler* as, size_t* size) {
+    void* memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory != MAP_FAILED) {
+        memcpy(memory, as->code, as->count);
+        if(mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, as->count);
+            memory = MAP_FAILED;
+        }
+    }
+    *size = as->count;
+    free(as->code);
+    free(as->patches);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+typedef Value* (*NativeCode)(Value* sp);
+
+bool jitRun(Chunk* chunk, InterpretResult* result) {
+    Assembler as = {0};
+    if(!translate(&as, chunk)) {
+        free(as.code);
+        free(as.patches);
+        return false;
+    }
+
+    size_t size;
+    void* memory = install(&as, &size);
+    if(memory == NULL) return false;
+
+    Value* sp = ((NativeCode)memory)(vm->sp);
+    munmap(memory, size);
+
+    if(sp == NULL) {
+        *result = INTERPRET_RUNTIME_ERROR;
+    } else {
+        vm->sp = sp;
+        *result = INTERPRET_OK;
+    }
+    return true;
+}
+
+// Tracing JIT (--trace-jit).
+//
+// Every taken OP_LOOP bumps a counter for the loop header it jumps back
+// to. Once a header is hot, run() swaps in a dispatch table that calls
+// jitRecord() before each instruction, and the recorder notes what one
+// trip round the loop executes: which way each branch went and which
+// operand types each instruction saw. When the trip ends back at the
+// header, the steps are compiled into a straight line of native code that
+// jumps back to its own start, so the whole loop runs without returning.
+//
+// The trace keeps the value stack in memory exactly as run() would, and
+// every guard runs before its instruction has any effect. A failed type
+// guard or a branch going the other way therefore exits by setting vm->ip
+// to that instruction (or to the branch's other side) and returning the
+// stack top, and run() carries on from there as if it had been
+// interpreting all along.
+
+// Taken back-edges before a loop is recorded.
+#define HOT_LOOP 50
+// Loops whose recording failed this often are left to the interpreter.
+#define MAX_TRACE_ABORTS 3
+#define MAX_TRACE_LENGTH 512
+
+typedef struct {
+    int offset;
+    uint8_t op;     // generic opcode; quickened forms are recorded as such
+    bool strings;   // OP_ADD saw two strings rather than two numbers
+    bool taken;     // a conditional jump went to its target
+} TraceStep;
+
+typedef struct {
+    void* code;
+    size_t size;
+} Trace;
+
+struct Tracer {
+    Chunk* chunk;
+    int* hotness;        // per loop header offset; -1 once given up on
+    uint8_t* aborts;
+    Trace* traces;
+
+    bool recording;
+    int header;
+    TraceStep steps[MAX_TRACE_LENGTH];
+    int stepCount;
+};
+
+void jitFreeTraces() {
+    Tracer* tracer = vm->tracer;
+    if(tracer == NULL || tracer->chunk == NULL) return;
+    for(int i = 0; i < tracer->chunk->count; i++) {
+        if(tracer->traces[i].code != NULL) munmap(tracer->traces[i].code, tracer->traces[i].size);
+    }
+    free(tracer->hotness);
+    free(tracer->aborts);
+    free(tracer->traces);
+    tracer->chunk = NULL;
+    tracer->recording = false;
+}
+
+void jitFreeTracer() {
+    jitFreeTraces();
+    free(vm->tracer);
+    vm->tracer = NULL;
+}
+
+static void useChunk(Chunk* chunk) {
+    if(vm->tracer == NULL) {
+        vm->tracer = (Tracer*)calloc(1, sizeof(Tracer));
+        if(vm->tracer == NULL) exit(1);
+    }
+    Tracer* tracer = vm->tracer;
+    if(tracer->chunk == chunk) return;
+    jitFreeTraces();
+    tracer->chunk = chunk;
+    tracer->hotness = (int*)calloc(chunk->count, sizeof(int));
+    tracer->aborts = (uint8_t*)calloc(chunk->count, sizeof(uint8_t));
+    tracer->traces = (Trace*)calloc(chunk->count, sizeof(Trace));
+    if(tracer->hotness == NULL || tracer->aborts == NULL || tracer->traces == NULL) exit(1);
+}
+
+static uint8_t genericOpcode(uint8_t op) {
+    switch (op) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:     return OP_ADD;
+        case OP_EQUAL_NUM:   return OP_EQUAL;
+        case OP_GREATER_NUM: return OP_GREATER;
+        case OP_LESS_NUM:    return OP_LESS;
+        default:             return op;
+    }
+}
+
+// Side exits are recorded as patches whose target is the bytecode offset
+// to resume at; each gets a stub that stores vm->ip and leaves.
+static void addSideExit(Assembler* as, int at, int resume) {
+    addPatch(as, at, resume);
+}
+
+static void emitTraceStep(Assembler* as, Chunk* chunk, TraceStep* step, int loopStart) {
+    Tracer* tracer = vm->tracer;
+    uint8_t* code = chunk->code + step->offset;
+    Value* constants = chunk->constants.values;
+    int next = step->offset + instructionLength(code[0]);
+    int notNumber[2];
+
+    switch (step->op) {
+        case OP_ADD:
+            if(step->strings) {
+                emitCall(as, jitAdd, next, 0);
+                return;
+            }
+            emitArithmeticFast(as, 0x58, notNumber);
+            break;
+        case OP_SUBTRACT:      emitArithmeticFast(as, 0x5c, notNumber); break;
+        case OP_MULTIPLY:      emitArithmeticFast(as, 0x59, notNumber); break;
+        case OP_DIVIDE:        emitArithmeticFast(as, 0x5e, notNumber); break;
+        case OP_LESS:          emitComparisonFast(as, true, false, notNumber); break;
+        case OP_GREATER:       emitComparisonFast(as, false, false, notNumber); break;
+        case OP_GREATER_EQUAL: emitComparisonFast(as, true, true, notNumber); break;
+        case OP_LESS_EQUAL:    emitComparisonFast(as, false, true, notNumber); break;
+        case OP_INC_LOCAL_CONST:
+            emitIncLocalFast(as, code[1], constants[code[2]], notNumber);
+            break;
+
+        case OP_NEGATE:
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            addSideExit(as, emitNotNumber(as, RAX), step->offset);
+            EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f);
+            emitStore(as, RBX, -(int)sizeof(Value), RAX);
+            return;
+
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            int target = next + ((code[3] << 8) | code[4]);
+            emitLessLocalFast(as, code[1], constants[code[2]], notNumber);
+            addSideExit(as, notNumber[0], step->offset);
+            addSideExit(as, notNumber[1], step->offset);
+            if(step->taken) {
+                addSideExit(as, emitJumpIf(as, CC_A), next);
+            } else {
+                addSideExit(as, emitJumpIf(as, CC_BE), target);
+            }
+            return;
+        }
+
+        case OP_FOR_NUM_PREP:
+            emitForPrepFast(as, chunk, code, notNumber);
+            addSideExit(as, notNumber[0], step->offset);
+            addSideExit(as, notNumber[1], step->offset);
+            if(step->taken) {
+                addSideExit(as, emitJumpIf(as, CC_A), next);
+            } else {
+                addSideExit(as, emitJumpIf(as, CC_BE), next + jumpOffset(code));
+            }
+            return;
+
+        // Only recorded as the back-edge that closes the trace.
+        case OP_FOR_NUM_LOOP:
+            emitSafepoint(as, next);
+            emitForLoopFast(as, chunk, code, notNumber);
+            addSideExit(as, notNumber[0], step->offset);
+            addSideExit(as, notNumber[1], step->offset);
+            addSideExit(as, emitJumpIf(as, CC_BE), next);
+            patchTo(as, emitJump(as), loopStart);
+            return;
+
+        case OP_JUMP_IF_FALSE: {
+            int target = next + ((code[1] << 8) | code[2]);
+            int falsey[3];
+            emitLoad(as, RAX, RBX, -(int)sizeof(Value));
+            emitFalseyJumps(as, falsey);
+            if(step->taken) {
+                addSideExit(as, emitJump(as), next);
+                for(int i = 0; i < 3; i++) bindHere(as, falsey[i]);
+            } else {
+                for(int i = 0; i < 3; i++) addSideExit(as, falsey[i], target);
+            }
+            return;
+        }
+
+        // The trace is already laid out in execution order.
+        case OP_JUMP:
+            return;
+        case OP_LOOP: {
+            int target = next - ((code[1] << 8) | code[2]);
+            if(target == tracer->header) {
+                emitSafepoint(as, next);
+                patchTo(as, emitJump(as), loopStart);
+            }
+            return;
+        }
+
+        default:
+            // The rest cannot fail on types, so the baseline templates do.
+            emitInstruction(as, chunk, step->offset);
+            return;
+    }
+
+    addSideExit(as, notNumber[0], step->offset);
+    addSideExit(as, notNumber[1], step->offset);
+}
+
+static void compileTrace() {
+    Tracer* tracer = vm->tracer;
+    Chunk* chunk = tracer->chunk;
+    Assembler as = {0};
+    emitPrologue(&as);
+    int loopStart = as.count;
+    for(int i = 0; i < tracer->stepCount; i++) {
+        emitTraceStep(&as, chunk, &tracer->steps[i], loopStart);
+    }
+
+    int exitLabel, errorLabel;
+    emitEpilogue(&as, &exitLabel, &errorLabel);
+
+    for(int i = 0; i < as.patchCount; i++) {
+        Patch* patch = &as.patches[i];
+        if(patch->target == TARGET_ERROR) {
+            patchTo(&as, patch->at, errorLabel);
+        } else if(patch->target == TARGET_EXIT) {
+            patchTo(&as, patch->at, exitLabel);
+        } else {
+            bindHere(&as, patch->at);
+            emitMovImm(&as, RAX, (uint64_t)(uintptr_t)(chunk->code + patch->target));
+            emitMovImm(&as, RCX, (uint64_t)(uintptr_t)&vm->ip);
+            emitStore(&as, RCX, 0, RAX);
+            patchTo(&as, emitJump(&as), exitLabel);
+        }
+    }
+
+    Trace* trace = &tracer->traces[tracer->header];
+    trace->code = install(&as, &trace->size);
+}
+
+static void abortRecording() {
+    Tracer* tracer = vm->tracer;
+    tracer->recording = false;
+    if(++tracer->aborts[tracer->header] >= MAX_TRACE_ABORTS) tracer->hotness[tracer->header] = -1;
+}
+
+static bool numbers(Value a, Value b) {
+    return IS_NUMBER(a) && IS_NUMBER(b);
+}
+
+// Whether OP_CONCAT_N would accept these operands: all numbers or all texts.
+static bool addable(Value* operands, int count) {
+    bool number = IS_NUMBER(operands[0]);
+    for(int i = 0; i < count; i++) {
+        if(number ? !IS_NUMBER(operands[i]) : !IS_TEXT(operands[i])) return false;
+    }
+    return true;
+}
+
+bool jitRecord(uint8_t* ip, Value* sp) {
+    Tracer* tracer = vm->tracer;
+    if(!tracer->recording) return false;
+    if(tracer->stepCount == MAX_TRACE_LENGTH) {
+        abortRecording();
+        return false;
+    }
+
+    Chunk* chunk = tracer->chunk;
+    TraceStep* step = &tracer->steps[tracer->stepCount++];
+    step->offset = (int)(ip - chunk->code);
+    step->op = genericOpcode(ip[0]);
+    step->strings = false;
+    step->taken = false;
+
+    // Anything about to raise a runtime error is left to run().
+    bool ok = true;
+    switch (step->op) {
+        case OP_ADD:
+            step->strings = IS_TEXT(sp[-1]) && IS_TEXT(sp[-2]);
+            ok = step->strings || numbers(sp[-1], sp[-2]);
+            break;
+        case OP_CONCAT_N:
+            ok = addable(sp - ip[1], ip[1]);
+            break;
+        case OP_CALL:
+            ok = IS_NATIVE(sp[-1 - ip[1]]) && AS_NATIVE(sp[-1 - ip[1]])->arity == ip[1];
+            break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            ok = numbers(sp[-1], sp[-2]);
+            break;
+        case OP_NEGATE:
+            ok = IS_NUMBER(sp[-1]);
+            break;
+        case OP_INC_LOCAL_CONST:
+            ok = numbers(vm->stack[ip[1]], chunk->constants.values[ip[2]]);
+            break;
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            Value local = vm->stack[ip[1]];
+            Value constant = chunk->constants.values[ip[2]];
+            ok = numbers(local, constant);
+            step->taken = ok && !(AS_NUMBER(local) < AS_NUMBER(constant));
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+            step->taken = isFalsey(sp[-1]);
+            break;
+        case OP_FOR_NUM_PREP:
+        case OP_FOR_NUM_LOOP: {
+            Value counter = vm->stack[ip[1]];
+            Value bound = ip[2] == FOR_BOUND_LOCAL ? vm->stack[ip[3]] : chunk->constants.values[ip[3]];
+            ok = numbers(counter, bound);
+            if(!ok) break;
+            if(step->op == OP_FOR_NUM_PREP) {
+                step->taken = !(AS_NUMBER(counter) < AS_NUMBER(bound));
+                break;
+            }
+
+            double next = AS_NUMBER(counter) + AS_NUMBER(chunk->constants.values[ip[4]]);
+            int target = step->offset + 7 - ((ip[5] << 8) | ip[6]);
+            if(target == tracer->header && next < AS_NUMBER(bound)) {
+                tracer->recording = false;
+                compileTrace();
+                return false;
+            }
+            ok = false;
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            ok = !IS_UNDEFINED(vm->globalValues.values[(ip[1] << 8) | ip[2]]);
+            break;
+        case OP_LOOP: {
+            int target = step->offset + 3 - ((ip[1] << 8) | ip[2]);
+            if(target == tracer->header) {
+                tracer->recording = false;
+                compileTrace();
+                return false;
+            }
+            // A back-edge into code already on the trace is an inner loop.
+            for(int i = 0; i < tracer->stepCount - 1; i++) {
+                if(tracer->steps[i].offset == target) ok = false;
+            }
+            break;
+        }
+        case OP_RETURN:
+            ok = false;
+            break;
+        default:
+            break;
+    }
+
+    if(!ok) {
+        abortRecording();
+        return false;
+    }
+    return true;
+}
+
+TraceAction jitLoopEdge(uint8_t* header, Value* sp) {
+    useChunk(vm->chunk);
+    Tracer* tracer = vm->tracer;
+    if(tracer->recording) return TRACE_NONE;
+
+    int offset = (int)(header - vm->chunk->code);
+    Trace* trace = &tracer->traces[offset];
+    if(trace->code != NULL) {
+        Value* result = ((NativeCode)trace->code)(sp);
+        if(result == NULL) return TRACE_ERROR;
+        vm->sp = result;
+        return TRACE_EXITED;
+    }
+
+    if(tracer->hotness[offset] < 0 || ++tracer->hotness[offset] < HOT_LOOP) return TRACE_NONE;
+    tracer->hotness[offset] = 0;
+    tracer->recording = true;
+    tracer->header = offset;
+    tracer->stepCount = 0;
+    return TRACE_RECORD;
+}
+
+#endif
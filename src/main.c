@@ -1,13 +1,24 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "symbols.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* isolate) {
     char line[1024];
     for(;;) {
         printf(">");
@@ -15,16 +26,14 @@ static void repl() {
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(isolate, line);
     }
 }
 
-static char* readFile(const char* path) {
+// Returns NULL, without complaining, if path cannot be opened.
+static char* tryReadFile(const char* path, size_t* size) {
     FILE* file = fopen(path, "rb");
-    if(!file) {
-        fprintf(stderr, "Invalid file path");
-        exit(1);
-    }
+    if(!file) return NULL;
     fseek(file, 0L, SEEK_END);
     size_t fileSize = ftell(file);
     rewind(file);
@@ -42,31 +51,458 @@ static char* readFile(const char* path) {
     buffer[bytesRead] = '\0';
 
     fclose(file);
+    *size = bytesRead;
     return buffer;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static char* readFile(const char* path, size_t* size) {
+    char* buffer = tryReadFile(path, size);
+    if(buffer == NULL) {
+        fprintf(stderr, "Invalid file path");
+        exit(1);
+    }
+    return buffer;
+}
+
+typedef struct {
+    uint8_t* bytes;
+    size_t size;
+    bool mapped;
+} FileImage;
+
+// Maps a bytecode image read-only, so the chunk runs from page-cache
+// pages shared with every other process running the same file. Falls back
+// to reading it into memory where it cannot be mapped. Returns false,
+// without complaining, if path cannot be opened.
+static bool openImage(const char* path, FileImage* image) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* bytes = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(bytes != MAP_FAILED) {
+            close(fd);
+            image->bytes = (uint8_t*)bytes;
+            image->size = (size_t)info.st_size;
+            image->mapped = true;
+            return true;
+        }
+    }
+    close(fd);
+    image->bytes = (uint8_t*)tryReadFile(path, &image->size);
+    image->mapped = false;
+    return image->bytes != NULL;
+}
 
-    if(result == INTERPRET_COMPILE_ERROR) exit(65);
-    if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void closeImage(FileImage* image) {
+    if(image->mapped) {
+        munmap(image->bytes, image->size);
+    } else {
+        free(image->bytes);
+    }
 }
 
+static bool endsWith(const char* string, const char* suffix) {
+    size_t length = strlen(string);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
 
-int main(int argc, const char* argv[]) {
-    initVM();
-    
-    if(argc == 1) {
-        repl();
-    } else if(argc == 2) {
-        runFile(argv[1]);
+// script.pot caches to script.potc; any other name gets .potc appended.
+static char* cachePath(const char* path) {
+    size_t length = strlen(path);
+    char* cache = (char*)malloc(length + 6);
+    if(cache == NULL) {
+        fprintf(stderr, "Out of memory");
+        exit(1);
+    }
+    strcpy(cache, path);
+    strcat(cache, endsWith(path, ".pot") ? "c" : ".potc");
+    return cache;
+}
+
+// Exit status of a script that cannot be read.
+#define EXIT_NO_INPUT 66
+
+// A .potc runs as is. A source file runs from its cache when one exists
+// that was compiled from exactly this source at this optimization level.
+// Returns the script's exit status.
+static int runScript(VM* isolate, const char* path) {
+    InterpretResult result;
+    FileImage image;
+    if(endsWith(path, ".potc")) {
+        if(!openImage(path, &image)) return EXIT_NO_INPUT;
+        result = interpretBytecode(isolate, image.bytes, image.size);
+        closeImage(&image);
     } else {
-        printf("Usage: potato [path]\n");
-        exit(64);
+        size_t size;
+        char* source = tryReadFile(path, &size);
+        if(source == NULL) return EXIT_NO_INPUT;
+        char* cache = cachePath(path);
+        if(openImage(cache, &image)) {
+            if(bytecodeFresh(image.bytes, image.size, hashSource(source, size))) {
+                result = interpretBytecode(isolate, image.bytes, image.size);
+            } else {
+                result = interpret(isolate, source);
+            }
+            closeImage(&image);
+        } else {
+            result = interpret(isolate, source);
+        }
+        free(cache);
+        free(source);
     }
 
-    exitVM();
+    if(result == INTERPRET_COMPILE_ERROR) return 65;
+    if(result == INTERPRET_RUNTIME_ERROR) return 70;
     return 0;
 }
+
+static int runFile(VM* isolate, const char* path) {
+    int status = runScript(isolate, path);
+    if(status == EXIT_NO_INPUT) {
+        fprintf(stderr, "Invalid file path");
+        exit(1);
+    }
+    return status;
+}
+
+// Batch mode: scripts run on a pool of worker threads, each with its own
+// VM that is reset between scripts. A script's output is captured while
+// it runs and written out in the order the scripts were given.
+typedef struct {
+    const char* path;
+    char* out;
+    size_t outSize;
+    char* err;
+    size_t errSize;
+    int status;
+    double seconds;
+    bool done;
+} BatchScript;
+
+// Channels named with --channel, defined as globals in every VM.
+#define CHANNEL_CAPACITY 256
+
+typedef struct {
+    const char** names;
+    Channel** channels;
+    int count;
+    int capacity;
+} ChannelList;
+
+static void addChannel(ChannelList* list, const char* name) {
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->names = (const char**)realloc(list->names, sizeof(const char*) * list->capacity);
+        list->channels = (Channel**)realloc(list->channels, sizeof(Channel*) * list->capacity);
+        if(list->names == NULL || list->channels == NULL) exit(1);
+    }
+    list->names[list->count] = name;
+    list->channels[list->count++] = potatoNewChannel(CHANNEL_CAPACITY);
+}
+
+static void defineChannels(VM* isolate, const ChannelList* list) {
+    for(int i = 0; i < list->count; i++) potatoDefineChannel(isolate, list->names[i], list->channels[i]);
+}
+
+static void freeChannels(ChannelList* list) {
+    for(int i = 0; i < list->count; i++) potatoReleaseChannel(list->channels[i]);
+    free(list->names);
+    free(list->channels);
+}
+
+typedef struct {
+    VM* settings;
+    const ChannelList* channels;
+    BatchScript* scripts;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static FILE* captureStream(char** buffer, size_t* size) {
+    FILE* stream = open_memstream(buffer, size);
+    if(stream == NULL) {
+        fprintf(stderr, "Out of memory");
+        exit(1);
+    }
+    return stream;
+}
+
+// Returns the worker's VM, which the main thread frees once every worker
+// is done so that statistics come out one VM at a time.
+static void* batchWorker(void* argument) {
+    Batch* batch = (Batch*)argument;
+    VM* isolate = potatoNewVM();
+    isolate->gcStats = batch->settings->gcStats;
+    isolate->allocStats = batch->settings->allocStats;
+    isolate->arenaMode = batch->settings->arenaMode;
+    isolate->nurserySize = batch->settings->nurserySize;
+    isolate->gcPauseBudget = batch->settings->gcPauseBudget;
+    defineChannels(isolate, batch->channels);
+
+    for(;;) {
+        pthread_mutex_lock(&batch->lock);
+        int index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if(index >= batch->count) break;
+
+        BatchScript* script = &batch->scripts[index];
+        isolate->out = captureStream(&script->out, &script->outSize);
+        isolate->err = captureStream(&script->err, &script->errSize);
+        double start = now();
+        script->status = runScript(isolate, script->path);
+        script->seconds = now() - start;
+        if(script->status == EXIT_NO_INPUT) {
+            fprintf(isolate->err, "Could not read %s\n", script->path);
+        }
+        fclose(isolate->out);
+        fclose(isolate->err);
+        isolate->out = stdout;
+        isolate->err = stderr;
+        potatoResetVM(isolate);
+        defineChannels(isolate, batch->channels);
+
+        pthread_mutex_lock(&batch->lock);
+        script->done = true;
+        pthread_cond_broadcast(&batch->finished);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return isolate;
+}
+
+static int compareSeconds(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+static double percentile(double* sorted, int count, double fraction) {
+    int index = (int)(fraction * count + 0.999999) - 1;
+    if(index < 0) index = 0;
+    return sorted[index];
+}
+
+static void printBatchStats(BatchScript* scripts, int count, int jobs, double elapsed) {
+    if(count <= 0) return;
+    double* latencies = (double*)malloc(sizeof(double) * (size_t)count);
+    if(latencies == NULL) exit(1);
+    for(int i = 0; i < count; i++) latencies[i] = scripts[i].seconds;
+    qsort(latencies, count, sizeof(double), compareSeconds);
+
+    fprintf(stderr, "[batch] %d scripts on %d workers in %.3f s, %.1f scripts/s\n",
+            count, jobs, elapsed, count / elapsed);
+    fprintf(stderr, "[batch] latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            percentile(latencies, count, 0.5) * 1000, percentile(latencies, count, 0.9) * 1000,
+            percentile(latencies, count, 0.99) * 1000, latencies[count - 1] * 1000);
+    free(latencies);
+}
+
+// Returns the highest exit status of any script.
+static int runBatch(VM* settings, const ChannelList* channels, const char** paths, int count, int jobs) {
+    if(count == 0) return 0;
+    if(jobs > count) jobs = count;
+
+    Batch batch;
+    batch.settings = settings;
+    batch.channels = channels;
+    batch.scripts = (BatchScript*)calloc(count, sizeof(BatchScript));
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * jobs);
+    if(batch.scripts == NULL || workers == NULL) exit(1);
+    for(int i = 0; i < count; i++) batch.scripts[i].path = paths[i];
+    batch.count = count;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    double start = now();
+    for(int i = 0; i < jobs; i++) {
+        if(pthread_create(&workers[i], NULL, batchWorker, &batch) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            exit(1);
+        }
+    }
+
+    int status = 0;
+    for(int i = 0; i < count; i++) {
+        BatchScript* script = &batch.scripts[i];
+        pthread_mutex_lock(&batch.lock);
+        while(!script->done) pthread_cond_wait(&batch.finished, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        fwrite(script->out, 1, script->outSize, stdout);
+        fflush(stdout);
+        fwrite(script->err, 1, script->errSize, stderr);
+        free(script->out);
+        free(script->err);
+        if(script->status != 0) {
+            fprintf(stderr, "[batch] %s: exit %d\n", script->path, script->status);
+            if(script->status > status) status = script->status;
+        }
+    }
+    double elapsed = now() - start;
+
+    for(int i = 0; i < jobs; i++) {
+        void* isolate;
+        pthread_join(workers[i], &isolate);
+        potatoFreeVM((VM*)isolate);
+    }
+    // The workers have reported their own statistics.
+    settings->gcStats = false;
+    settings->allocStats = false;
+    printBatchStats(batch.scripts, count, jobs, elapsed);
+
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    free(batch.scripts);
+    return status;
+}
+
+typedef struct {
+    const char** paths;
+    int count;
+    int capacity;
+} PathList;
+
+static void addPath(PathList* list, const char* path) {
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->paths = (const char**)realloc(list->paths, sizeof(const char*) * list->capacity);
+        if(list->paths == NULL) exit(1);
+    }
+    list->paths[list->count++] = path;
+}
+
+// A manifest names one script per line; blank lines and lines starting
+// with # are skipped. The returned buffer holds the paths.
+static char* readManifest(const char* path, PathList* list) {
+    size_t size;
+    char* manifest = readFile(path, &size);
+    char* line = manifest;
+    while(line < manifest + size) {
+        char* end = line + strcspn(line, "\n");
+        char* next = *end == '\0' ? end : end + 1;
+        while(end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+        *end = '\0';
+        if(line[0] != '\0' && line[0] != '#') addPath(list, line);
+        line = next;
+    }
+    return manifest;
+}
+
+static int compileFile(VM* isolate, const char* path, const char* output) {
+    size_t size;
+    char* source = readFile(path, &size);
+    VM* previous = bindVM(isolate);
+    Chunk chunk;
+    initChunk(&chunk);
+    bool compiled = compile(source, &chunk);
+    int status = 0;
+    if(!compiled) {
+        status = 65;
+    } else if(!writeBytecode(&chunk, hashSource(source, size), output)) {
+        fprintf(stderr, "Could not write %s\n", output);
+        status = 74;
+    }
+    freeChunk(&chunk);
+    bindVM(previous);
+    free(source);
+    return status;
+}
+
+static void usage() {
+    printf("Usage: potato [-O0|-O1|-O2] [--gc-stats] [--alloc-stats] [--arena] [--nursery-kb N] [--gc-pause-us N] [--jit|--trace-jit] [--shared-symbols] [--channel name]... [path]\n");
+    printf("       potato [-O0|-O1|-O2] --compile in.pot -o out.potc\n");
+    printf("       potato [options] --jobs N [--manifest list] [path...]\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    VM* isolate = potatoNewVM();
+
+    PathList paths = {NULL, 0, 0};
+    ChannelList channels = {NULL, NULL, 0, 0};
+    const char* manifest = NULL;
+    const char* output = NULL;
+    bool compileOnly = false;
+    int jobs = 0;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--gc-stats") == 0) {
+            isolate->gcStats = true;
+        } else if(strcmp(argv[i], "--alloc-stats") == 0) {
+            isolate->allocStats = true;
+        } else if(strcmp(argv[i], "--arena") == 0) {
+            isolate->arenaMode = true;
+        } else if(strcmp(argv[i], "--nursery-kb") == 0 && i + 1 < argc) {
+            isolate->nurserySize = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if(strcmp(argv[i], "--gc-pause-us") == 0 && i + 1 < argc) {
+            isolate->gcPauseBudget = strtod(argv[++i], NULL) / 1000.0;
+        } else if(strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if(strcmp(argv[i], "--shared-symbols") == 0) {
+            if(!sharedSymbols) initSymbols();
+        } else if(strcmp(argv[i], "--channel") == 0 && i + 1 < argc) {
+            addChannel(&channels, argv[++i]);
+        } else if(strcmp(argv[i], "--jit") == 0) {
+            jitEnabled = true;
+        } else if(strcmp(argv[i], "--trace-jit") == 0) {
+            traceJitEnabled = true;
+        } else if(strcmp(argv[i], "-O0") == 0) {
+            optimizeLevel = 0;
+        } else if(strcmp(argv[i], "-O1") == 0) {
+            optimizeLevel = 1;
+        } else if(strcmp(argv[i], "-O2") == 0) {
+            optimizeLevel = 2;
+        } else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if(jobs < 1) usage();
+        } else if(strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if(argv[i][0] != '-') {
+            addPath(&paths, argv[i]);
+        } else {
+            usage();
+        }
+    }
+
+    bool batch = jobs > 0;
+    if(compileOnly != (output != NULL) || (compileOnly && (paths.count != 1 || batch))) usage();
+    if(!batch && (paths.count > 1 || manifest != NULL)) usage();
+    defineChannels(isolate, &channels);
+
+    // Batch mode hands the statistics flags to its workers.
+    bool allocStats = isolate->allocStats;
+    int status = 0;
+    char* manifestPaths = NULL;
+    if(batch) {
+        if(manifest != NULL) manifestPaths = readManifest(manifest, &paths);
+        status = runBatch(isolate, &channels, paths.paths, paths.count, jobs);
+    } else if(compileOnly) {
+        status = compileFile(isolate, paths.paths[0], output);
+    } else if(paths.count == 0) {
+        repl(isolate);
+    } else {
+        status = runFile(isolate, paths.paths[0]);
+    }
+
+    potatoFreeVM(isolate);
+    freeChannels(&channels);
+    if(sharedSymbols) {
+        if(allocStats) printSymbolStats();
+        freeSymbols();
+    }
+    free(manifestPaths);
+    free(paths.paths);
+    return status;
+}
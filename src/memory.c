@@ -1,10 +1,155 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
+#include "channel.h"
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* ptr, size_t oldSize, size_t newSize) {
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+
+#ifndef NO_POOL_ALLOC
+
+// Blocks of up to POOL_MAX_SIZE bytes come from per-size-class free lists
+// carved out of SLAB_SIZE slabs; anything larger goes to malloc. Callers of
+// reallocate() always pass a block's size back in, so blocks carry no
+// header and the size picks the class.
+#define POOL_GRANULE  16
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASSES)
+#define SLAB_SIZE     (64 * 1024)
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Each slab starts with this header, padded to keep blocks 16-byte aligned.
+struct Slab {
+    Slab* next;
+    char padding[POOL_GRANULE - sizeof(Slab*)];
+};
+
+static int sizeClass(size_t size) {
+    return (int)((size - 1) / POOL_GRANULE);
+}
+
+static size_t classSize(int bucket) {
+    return (size_t)(bucket + 1) * POOL_GRANULE;
+}
+
+static void* poolAllocate(size_t size) {
+    int bucket = sizeClass(size);
+    vm->pool.smallAllocs++;
+    vm->pool.liveRequested += size;
+    vm->pool.liveBlocks += classSize(bucket);
+    if(vm->pool.liveBlocks > vm->pool.peakBlocks) vm->pool.peakBlocks = vm->pool.liveBlocks;
+
+    FreeBlock* block = vm->pool.freeLists[bucket];
+    if(block != NULL) {
+        vm->pool.freeListHits++;
+        vm->pool.freeLists[bucket] = block->next;
+        return block;
+    }
+
+    // Whatever is left of the current slab is abandoned.
+    if(vm->pool.cursor == NULL || vm->pool.limit - vm->pool.cursor < (ptrdiff_t)classSize(bucket)) {
+        Slab* slab = (Slab*)malloc(SLAB_SIZE);
+        if(slab == NULL) exit(1);
+        slab->next = vm->pool.slabs;
+        vm->pool.slabs = slab;
+        vm->pool.slabCount++;
+        vm->pool.cursor = (char*)(slab + 1);
+        vm->pool.limit = (char*)slab + SLAB_SIZE;
+    }
+    void* result = vm->pool.cursor;
+    vm->pool.cursor += classSize(bucket);
+    return result;
+}
+
+static void poolFree(void* ptr, size_t size) {
+    int bucket = sizeClass(size);
+    vm->pool.liveRequested -= size;
+    vm->pool.liveBlocks -= classSize(bucket);
+
+    FreeBlock* block = (FreeBlock*)ptr;
+    block->next = vm->pool.freeLists[bucket];
+    vm->pool.freeLists[bucket] = block;
+}
+
+static void* allocateBlock(size_t size) {
+    if(size <= POOL_MAX_SIZE) return poolAllocate(size);
+    vm->pool.largeAllocs++;
+    void* result = malloc(size);
+    if(result == NULL) exit(1);
+    return result;
+}
+
+static void freeBlock(void* ptr, size_t size) {
+    if(size <= POOL_MAX_SIZE) {
+        poolFree(ptr, size);
+    } else {
+        free(ptr);
+    }
+}
+
+static void* resizeBlock(void* ptr, size_t oldSize, size_t newSize) {
+    if(newSize == 0) {
+        if(ptr != NULL) freeBlock(ptr, oldSize);
+        return NULL;
+    }
+    if(ptr == NULL) return allocateBlock(newSize);
+
+    if(oldSize > POOL_MAX_SIZE && newSize > POOL_MAX_SIZE) {
+        void* result = realloc(ptr, newSize);
+        if(result == NULL) exit(1);
+        return result;
+    }
+    if(oldSize <= POOL_MAX_SIZE && newSize <= POOL_MAX_SIZE &&
+       sizeClass(oldSize) == sizeClass(newSize)) {
+        vm->pool.liveRequested += newSize - oldSize;
+        return ptr;
+    }
+
+    void* result = allocateBlock(newSize);
+    memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+    freeBlock(ptr, oldSize);
+    return result;
+}
+
+static void printPoolStats() {
+    size_t slabBytes = vm->pool.slabCount * SLAB_SIZE;
+    fprintf(stderr, "[alloc] %zu small allocations, %.1f%% from free lists, %zu large\n",
+            vm->pool.smallAllocs,
+            vm->pool.smallAllocs > 0 ? 100.0 * vm->pool.freeListHits / vm->pool.smallAllocs : 0.0,
+            vm->pool.largeAllocs);
+    fprintf(stderr, "[alloc] %zu slabs (%zu bytes), %zu bytes in live blocks holding %zu requested\n",
+            vm->pool.slabCount, slabBytes, vm->pool.liveBlocks, vm->pool.liveRequested);
+    fprintf(stderr, "[alloc] fragmentation: %.1f%% internal, %.1f%% of slab space unused at peak\n",
+            vm->pool.liveBlocks > 0 ? 100.0 * (vm->pool.liveBlocks - vm->pool.liveRequested) / vm->pool.liveBlocks : 0.0,
+            slabBytes > 0 ? 100.0 * (slabBytes - vm->pool.peakBlocks) / slabBytes : 0.0);
+}
+
+void freePool() {
+    Slab* slab = vm->pool.slabs;
+    while(slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(&vm->pool, 0, sizeof(vm->pool));
+}
+
+#else
+
+static void* resizeBlock(void* ptr, size_t oldSize, size_t newSize) {
+    (void)oldSize;
     if(newSize == 0) {
         free(ptr);
         return NULL;
@@ -15,22 +160,748 @@ void* reallocate(void* ptr, size_t oldSize, size_t newSize) {
     return result;
 }
 
+static void printPoolStats() {
+    fprintf(stderr, "[alloc] built with NO_POOL_ALLOC, no pool statistics\n");
+}
+
+void freePool() {
+}
+
+#endif
+
+// The request region is one contiguous reservation, so telling region
+// blocks from heap blocks is a range check. Region blocks are never freed
+// one at a time; the whole region is reset by releaseRegion(). Region
+// memory does not count toward collections, which only ever reclaim heap
+// objects.
+#define REGION_RESERVE ((size_t)1 << 30)
+#define REGION_ALIGN   16
+// Pages beyond this are handed back to the system on release.
+#define REGION_KEEP    (1024 * 1024)
+
+bool inRegion(const void* ptr) {
+    return (const char*)ptr >= vm->region.base && (const char*)ptr < vm->region.limit;
+}
+
+void openRegion() {
+    if(vm->region.base == NULL) {
+        void* base = mmap(NULL, REGION_RESERVE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base == MAP_FAILED) exit(1);
+        vm->region.base = (char*)base;
+        vm->region.cursor = vm->region.base;
+        vm->region.limit = vm->region.base + REGION_RESERVE;
+    }
+    vm->region.open = true;
+    vm->region.requests++;
+}
+
+void closeRegion() {
+    vm->region.open = false;
+}
+
+void releaseRegion() {
+    // The cycle in progress may still reach region objects.
+    finishCollection();
+    size_t used = (size_t)(vm->region.cursor - vm->region.base);
+    if(used > vm->region.peakUsed) vm->region.peakUsed = used;
+    if(used > REGION_KEEP) {
+        madvise(vm->region.base + REGION_KEEP, used - REGION_KEEP, MADV_DONTNEED);
+    }
+    vm->region.cursor = vm->region.base;
+    vm->region.exhausted = false;
+    vm->regionObjects = NULL;
+}
+
+void freeRegion() {
+    if(vm->region.base != NULL) munmap(vm->region.base, REGION_RESERVE);
+    vm->region.base = NULL;
+    vm->region.cursor = NULL;
+    vm->region.limit = NULL;
+}
+
+void printAllocStats() {
+    printPoolStats();
+    if(vm->region.requests > 0) {
+        fprintf(stderr, "[alloc] %d requests in the region, peak %zu bytes, %d ran out\n",
+                vm->region.requests, vm->region.peakUsed, vm->region.exhaustions);
+    }
+}
+
+static void* heapReallocate(void* ptr, size_t oldSize, size_t newSize);
+
+// New blocks come from the region while it is open. A region block that
+// is resized after the region closed, which is how survivors are
+// promoted, moves to the heap. So does every block once the region has
+// run out: nothing in it can be freed before the call ends, but heap
+// blocks can, so a call that keeps little alive still finishes.
+static void* regionReallocate(void* ptr, size_t oldSize, size_t newSize) {
+    bool fromRegion = inRegion(ptr);
+    if(newSize == 0) {
+        if(!fromRegion) heapReallocate(ptr, oldSize, 0);
+        return NULL;
+    }
+
+    void* result = NULL;
+    if(vm->region.open && !vm->region.exhausted) {
+#ifdef DEBUG_STRESS_GC
+        collectGarbage();
+#endif
+        size_t size = (newSize + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+        if((size_t)(vm->region.limit - vm->region.cursor) >= size) {
+            result = vm->region.cursor;
+            vm->region.cursor += size;
+        } else {
+            vm->region.exhausted = true;
+            vm->region.exhaustions++;
+        }
+    }
+    if(result == NULL) result = heapReallocate(NULL, 0, newSize);
+
+    if(ptr != NULL) {
+        memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+        if(!fromRegion) heapReallocate(ptr, oldSize, 0);
+    }
+    return result;
+}
+
+static void freeYoung(void* ptr, size_t size);
+
+void* reallocate(void* ptr, size_t oldSize, size_t newSize) {
+    if(vm->region.open || inRegion(ptr)) return regionReallocate(ptr, oldSize, newSize);
+    if(isYoung(ptr)) {
+        freeYoung(ptr, oldSize);
+        return NULL;
+    }
+    return heapReallocate(ptr, oldSize, newSize);
+}
+
+static void collectIfDue();
+
+static void* heapReallocate(void* ptr, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
+    if(newSize > oldSize && !vm->evacuating) collectIfDue();
+
+    return resizeBlock(ptr, oldSize, newSize);
+}
+
+// The nursery: while run() executes, strings and ropes are bump-allocated
+// here, and collectYoung() copies the ones still reachable into the
+// mark-swept heap. Objects move, so collectYoung() only runs at
+// safepoints, the loop back-edges, where every live value sits in a stack
+// slot or a global. Allocation that finds the nursery full goes to the
+// heap and sets vm->nurseryFull for the next safepoint.
+//
+// Besides the stack and the globals, the roots are the heap ropes that
+// point into the nursery, recorded by writeBarrier(), and vm->strings,
+// whose young keys are listed so they can be moved or dropped without
+// scanning the table.
+#define YOUNG_ALIGN 8
+
+static size_t youngSize(size_t size) {
+    return (size + YOUNG_ALIGN - 1) & ~(size_t)(YOUNG_ALIGN - 1);
+}
+
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+        case OBJ_ROPE:   return sizeof(ObjRope);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_CHANNEL: return sizeof(ObjChannel);
+    }
+    return 0;
+}
+
+bool isYoung(const void* ptr) {
+    return (const char*)ptr >= vm->nursery.start && (const char*)ptr < vm->nursery.end;
+}
+
+void enableNursery(bool enabled) {
+    if(enabled && vm->nursery.start == NULL && vm->nurserySize > 0) {
+        vm->nursery.start = (char*)malloc(vm->nurserySize);
+        if(vm->nursery.start == NULL) exit(1);
+        vm->nursery.cursor = vm->nursery.start;
+        vm->nursery.end = vm->nursery.start + vm->nurserySize;
+    }
+    vm->nursery.enabled = enabled && vm->nursery.start != NULL;
+}
+
+void* allocatePinnedMemory(size_t size) {
+    return heapReallocate(NULL, 0, size);
+}
+
+void* allocateObjectMemory(size_t size) {
+    if(vm->nursery.enabled && !vm->region.open) {
+        size_t rounded = youngSize(size);
+        if((size_t)(vm->nursery.end - vm->nursery.cursor) >= rounded) {
+            void* result = vm->nursery.cursor;
+            vm->nursery.cursor += rounded;
+            vm->youngBytes += rounded;
+#ifdef DEBUG_STRESS_GC
+            vm->nurseryFull = true;
+#endif
+            return result;
+        }
+        vm->nurseryFull = true;
+    }
+    return reallocate(NULL, 0, size);
+}
+
+// Only reserved strings that turned out to be duplicates are freed young;
+// the newest allocation can simply be taken back.
+static void freeYoung(void* ptr, size_t size) {
+    size_t rounded = youngSize(size);
+    if((char*)ptr + rounded == vm->nursery.cursor) {
+        vm->nursery.cursor = (char*)ptr;
+        vm->youngBytes -= rounded;
+    }
+}
+
+static void growList(void** list, int* capacity, size_t elementSize) {
+    *capacity = GROW_CAPACITY(*capacity);
+    // Collector bookkeeping, so like the gray stack it bypasses reallocate().
+    *list = realloc(*list, elementSize * *capacity);
+    if(*list == NULL) exit(1);
+}
+
+void writeBarrier(Obj* owner, Obj* value) {
+    if(value == NULL) return;
+    if(vm->gcMarking) markObject(value);
+    if(!isYoung(value) || isYoung(owner) || inRegion(owner)) return;
+    if(vm->nursery.rememberedCount == vm->nursery.rememberedCapacity) {
+        growList((void**)&vm->nursery.remembered, &vm->nursery.rememberedCapacity, sizeof(Obj*));
+    }
+    vm->nursery.remembered[vm->nursery.rememberedCount++] = owner;
+}
+
+void rememberInterned(ObjString* string) {
+    if(!isYoung(string)) return;
+    if(vm->nursery.internedCount == vm->nursery.internedCapacity) {
+        growList((void**)&vm->nursery.interned, &vm->nursery.internedCapacity, sizeof(ObjString*));
+    }
+    vm->nursery.interned[vm->nursery.internedCount++] = string;
+}
+
+static void pushGray(Obj* object);
+
+// Copies a young object into the heap once, leaving a forwarding pointer
+// behind: a young object is never marked otherwise, so isMarked flags the
+// copy and next points at it. While a major cycle is marking, the copy is
+// shaded so that an already black owner does not hide it.
+static Obj* evacuate(Obj* object) {
+    if(object == NULL || !isYoung(object)) return object;
+    if(object->isMarked) return object->next;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)heapReallocate(NULL, 0, size);
+    memcpy(copy, object, size);
+    copy->isMarked = false;
+    copy->next = vm->objects;
+    vm->objects = copy;
+    vm->promotedBytes += youngSize(size);
+
+    object->isMarked = true;
+    object->next = copy;
+    if(copy->type == OBJ_ROPE) {
+        if(vm->nursery.pendingCount == vm->nursery.pendingCapacity) {
+            growList((void**)&vm->nursery.pending, &vm->nursery.pendingCapacity, sizeof(Obj*));
+        }
+        vm->nursery.pending[vm->nursery.pendingCount++] = copy;
+    }
+    if(vm->gcMarking) markObject(copy);
+    return copy;
+}
+
+static void evacuateValue(Value* slot) {
+    if(IS_OBJ(*slot) && isYoung(AS_OBJ(*slot))) *slot = OBJ_VAL(evacuate(AS_OBJ(*slot)));
+}
+
+static void evacuateFields(Obj* object) {
+    if(object->type != OBJ_ROPE) return;
+    ObjRope* rope = (ObjRope*)object;
+    rope->left = evacuate(rope->left);
+    rope->right = evacuate(rope->right);
+    rope->flat = (ObjString*)evacuate((Obj*)rope->flat);
+}
+
+static double nowMillis();
+static void recordPause(double pause);
+
+void collectYoung() {
+    vm->nurseryFull = false;
+    if(vm->nursery.start == NULL || vm->nursery.cursor == vm->nursery.start) return;
+
+    double start = nowMillis();
+    vm->evacuating = true;
+
+    for(Value* slot = vm->stack; slot < vm->sp; slot++) evacuateValue(slot);
+    for(uint32_t i = 0; i < vm->globalValues.count; i++) {
+        evacuateValue(&vm->globalValues.values[i]);
+    }
+    for(int i = 0; i < vm->nursery.rememberedCount; i++) {
+        evacuateFields(vm->nursery.remembered[i]);
+    }
+    while(vm->nursery.pendingCount > 0) evacuateFields(vm->nursery.pending[--vm->nursery.pendingCount]);
+
+    // A young key either moved, keeping its hash, or died.
+    for(int i = 0; i < vm->nursery.internedCount; i++) {
+        ObjString* string = vm->nursery.interned[i];
+        if(string->obj.isMarked) {
+            tableRekey(&vm->strings, string, (ObjString*)string->obj.next);
+        } else {
+            tableDelete(&vm->strings, string);
+        }
+    }
+
+#ifdef DEBUG_STRESS_GC
+    // Make any pointer left behind into the nursery fail loudly.
+    memset(vm->nursery.start, 0xdb, vm->nursery.cursor - vm->nursery.start);
+#endif
+    vm->nursery.cursor = vm->nursery.start;
+    vm->nursery.rememberedCount = 0;
+    vm->nursery.internedCount = 0;
+    vm->evacuating = false;
+
+    double pause = nowMillis() - start;
+    vm->minorCount++;
+    if(pause > vm->minorPauseMax) vm->minorPauseMax = pause;
+    recordPause(pause);
+
+    collectIfDue();
+}
+
+// Major collections never mark young objects, whose isMarked is taken by
+// forwarding. Instead every young rope counts as live and its fields are
+// roots until the next minor collection. The nursery can be walked
+// because every block in it starts with an object header.
+static void markNursery() {
+    for(char* at = vm->nursery.start; at < vm->nursery.cursor;) {
+        Obj* object = (Obj*)at;
+        if(object->type == OBJ_ROPE) {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+        }
+        at += youngSize(objectSize(object));
+    }
+}
+
+// Remembered ropes the full collection is about to free.
+static void dropUnmarkedRemembered() {
+    int kept = 0;
+    for(int i = 0; i < vm->nursery.rememberedCount; i++) {
+        if(vm->nursery.remembered[i]->isMarked) vm->nursery.remembered[kept++] = vm->nursery.remembered[i];
+    }
+    vm->nursery.rememberedCount = kept;
+}
+
+void resetNursery() {
+    vm->nursery.cursor = vm->nursery.start;
+    vm->nursery.rememberedCount = 0;
+    vm->nursery.internedCount = 0;
+    vm->nursery.pendingCount = 0;
+    vm->nurseryFull = false;
+}
+
+void freeNursery() {
+    free(vm->nursery.start);
+    free(vm->nursery.remembered);
+    free(vm->nursery.interned);
+    free(vm->nursery.pending);
+    memset(&vm->nursery, 0, sizeof(vm->nursery));
+}
+
+struct ArenaBlock {
+    ArenaBlock* next;
+};
+
+#define ARENA_BLOCK_SIZE (32 * 1024)
+#define ARENA_ALIGN 16
+
+void initArena(Arena* arena) {
+    arena->blocks = NULL;
+    arena->cursor = NULL;
+    arena->limit = NULL;
+}
+
+void* arenaAllocate(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(arena->cursor == NULL || (size_t)(arena->limit - arena->cursor) < size) {
+        size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        size_t blockSize = header + (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        ArenaBlock* block = (ArenaBlock*)malloc(blockSize);
+        if(block == NULL) exit(1);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->cursor = (char*)block + header;
+        arena->limit = (char*)block + blockSize;
+    }
+    void* result = arena->cursor;
+    arena->cursor += size;
+    return result;
+}
+
+void freeArena(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    initArena(arena);
+}
+
+void markObject(Obj* object) {
+    if(object == NULL || isYoung(object)) return;
+    if(object->isMarked) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+    pushGray(object);
+}
+
+static void pushGray(Obj* object) {
+    if(vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        // The gray stack is GC bookkeeping, so it bypasses reallocate().
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if(vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(Value value) {
+    if(IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+    for(uint32_t i = 0; i < array->count; i++) {
+        markValue(array->values[i]);
+    }
+}
+
+static void blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        case OBJ_CHANNEL:
+            // These hold no references into the heap.
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
 static void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            reallocate(object, STRING_SIZE(string->length), 0);
             break;
         }
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
+        case OBJ_NATIVE:
+            FREE(ObjNative, object);
+            break;
+        case OBJ_CHANNEL:
+            releaseChannel(((ObjChannel*)object)->channel);
+            FREE(ObjChannel, object);
+            break;
     }
 }
 
-void freeObjects() {
-    Obj* objects = vm.objects;
+// Major collections are incremental when vm->gcPauseBudget is set: a
+// cycle marks from a gray worklist and sweeps in steps of at most that
+// long, run after every GC_STEP_BYTES of heap growth. In between, the
+// mutator keeps the tri-color invariant with write barriers: storing into
+// a rope, a global or a table shades the stored value while vm->gcMarking
+// is set. The stack, chunk constants and the nursery have no barrier, so
+// finishMark() rescans them in one last atomic step before sweeping.
+//
+// Objects allocated during a cycle start white. Those reachable from a
+// barrier-free root are found by the rescan; the rest are garbage.
+#define GC_STEP_BYTES (64 * 1024)
+// Steps read the clock once per this many units of work.
+#define GC_CLOCK_INTERVAL 64
+
+static void markRoots() {
+    for(Value* slot = vm->stack; slot < vm->sp; slot++) {
+        markValue(*slot);
+    }
+
+    if(vm->chunk != NULL) markArray(&vm->chunk->constants);
+    markCompilerRoots();
+}
+
+static void beginCycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    vm->collector.phase = GC_MARK;
+    vm->collector.globalCursor = 0;
+    vm->gcMarking = true;
+    markRoots();
+}
+
+// The names in vm->globalNames are also the keys of vm->globalSlots, whose
+// values are plain slot numbers, so marking both arrays covers the table.
+static void markGlobal() {
+    uint32_t slot = vm->collector.globalCursor++;
+    markValue(vm->globalNames.values[slot]);
+    markValue(vm->globalValues.values[slot]);
+}
+
+static void finishMark() {
+    markRoots();
+    markNursery();
+    while(vm->grayCount > 0) blackenObject(vm->grayStack[--vm->grayCount]);
+    vm->gcMarking = false;
+
+    dropUnmarkedRemembered();
+    // Region objects are released with the region, so only their marks
+    // need clearing.
+    for(Obj* object = vm->regionObjects; object != NULL; object = object->next) {
+        object->isMarked = false;
+    }
+
+    vm->collector.unswept = vm->objects;
+    vm->collector.swept = NULL;
+    vm->collector.sweptTail = NULL;
+    vm->objects = NULL;
+    vm->collector.phase = GC_SWEEP;
+}
+
+// vm->strings is weak: an interned string is dropped from it as it is
+// freed, so the table never holds a swept string.
+static void sweepObject() {
+    Obj* object = vm->collector.unswept;
+    vm->collector.unswept = object->next;
+
+    if(object->isMarked) {
+        object->isMarked = false;
+        object->next = NULL;
+        if(vm->collector.sweptTail != NULL) {
+            vm->collector.sweptTail->next = object;
+        } else {
+            vm->collector.swept = object;
+        }
+        vm->collector.sweptTail = object;
+        return;
+    }
+
+    if(object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString*)object);
+    size_t before = vm->bytesAllocated;
+    freeObject(object);
+    vm->gcBytesFreed += before - vm->bytesAllocated;
+}
+
+static void finishSweep() {
+    if(vm->collector.sweptTail != NULL) {
+        vm->collector.sweptTail->next = vm->objects;
+        vm->objects = vm->collector.swept;
+    }
+    vm->collector.swept = NULL;
+    vm->collector.sweptTail = NULL;
+    vm->collector.phase = GC_IDLE;
+
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if(vm->nextGC < GC_MIN_HEAP) vm->nextGC = GC_MIN_HEAP;
+    vm->gcCount++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes live, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+// One unit of work: blacken a gray object, mark a global, sweep an
+// object, or one of the steps between phases.
+static void collectUnit() {
+    if(vm->collector.phase == GC_MARK) {
+        if(vm->grayCount > 0) {
+            blackenObject(vm->grayStack[--vm->grayCount]);
+        } else if(vm->collector.globalCursor < vm->globalValues.count) {
+            markGlobal();
+        } else {
+            finishMark();
+        }
+    } else if(vm->collector.unswept != NULL) {
+        sweepObject();
+    } else {
+        finishSweep();
+    }
+}
+
+static double nowMillis() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+static void recordPause(double pause) {
+    int bucket = 0;
+    for(double limit = 0.001; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 2) {
+        bucket++;
+    }
+    vm->gcPauseHistogram[bucket]++;
+}
+
+static void recordMajorPause(double pause) {
+    vm->gcPauseCount++;
+    vm->gcPauseTotal += pause;
+    if(pause > vm->gcPauseMax) vm->gcPauseMax = pause;
+    recordPause(pause);
+}
+
+// Runs the cycle for at most vm->gcPauseBudget. Stress builds do a single
+// unit per step so that the mutator runs between as many of them as
+// possible.
+static void collectStep() {
+    double start = nowMillis();
+    double deadline = start + vm->gcPauseBudget;
+    int units = 0;
+    while(vm->collector.phase != GC_IDLE) {
+        collectUnit();
+#ifdef DEBUG_STRESS_GC
+        break;
+#endif
+        if(++units % GC_CLOCK_INTERVAL == 0 && nowMillis() >= deadline) break;
+    }
+    recordMajorPause(nowMillis() - start);
+    vm->collector.nextStep = vm->bytesAllocated + GC_STEP_BYTES;
+}
+
+static void collectIfDue() {
+#ifdef DEBUG_STRESS_GC
+    bool due = true;
+    bool stepDue = true;
+#else
+    bool due = vm->bytesAllocated > vm->nextGC;
+    bool stepDue = vm->bytesAllocated >= vm->collector.nextStep;
+#endif
+    if(vm->gcPauseBudget <= 0) {
+        if(due) collectGarbage();
+        return;
+    }
+
+    if(vm->collector.phase == GC_IDLE) {
+        if(!due) return;
+        beginCycle();
+    } else if(vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR) {
+        // The mutator is outrunning the steps; finish before the heap
+        // grows without bound.
+        collectGarbage();
+        return;
+    } else if(!stepDue) {
+        return;
+    }
+    collectStep();
+}
+
+void collectGarbage() {
+    double start = nowMillis();
+    if(vm->collector.phase == GC_IDLE) beginCycle();
+    while(vm->collector.phase != GC_IDLE) collectUnit();
+    recordMajorPause(nowMillis() - start);
+}
+
+void finishCollection() {
+    if(vm->collector.phase != GC_IDLE) collectGarbage();
+}
+
+void retainInterned(ObjString* string) {
+    if(vm->collector.phase == GC_MARK) {
+        markObject((Obj*)string);
+    } else if(vm->collector.phase == GC_SWEEP && !isYoung(string) && !string->obj.isMarked) {
+        // Possibly not swept yet; a string has nothing to blacken, and a
+        // mark left on an already swept one only delays freeing it. Frozen
+        // strings are always marked and live in read-only memory.
+        string->obj.isMarked = true;
+    }
+}
+
+static int percentileBucket(double fraction) {
+    int total = 0;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) total += vm->gcPauseHistogram[i];
+    int seen = 0;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        seen += vm->gcPauseHistogram[i];
+        if(seen > 0 && seen >= fraction * total) return i;
+    }
+    return GC_PAUSE_BUCKETS - 1;
+}
+
+// Bucket 0 holds pauses under 1 us and bucket i those under 2^i us.
+static void printPauseHistogram() {
+    int total = 0;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) total += vm->gcPauseHistogram[i];
+    if(total == 0) return;
+
+    fprintf(stderr, "[gc] %d pauses, p50 < %d us, p99 < %d us, p99.9 < %d us\n",
+            total, 1 << percentileBucket(0.5), 1 << percentileBucket(0.99),
+            1 << percentileBucket(0.999));
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if(vm->gcPauseHistogram[i] == 0) continue;
+        fprintf(stderr, "[gc]   %6d - %6d us: %d\n",
+                i == 0 ? 0 : 1 << (i - 1), 1 << i, vm->gcPauseHistogram[i]);
+    }
+}
+
+void printGCStats() {
+    fprintf(stderr, "[gc] %d collections, %zu bytes reclaimed, %zu bytes live\n",
+            vm->gcCount, vm->gcBytesFreed, vm->bytesAllocated);
+    fprintf(stderr, "[gc] %d major pauses, total %.3f ms, max %.3f ms, mean %.3f ms\n",
+            vm->gcPauseCount, vm->gcPauseTotal, vm->gcPauseMax,
+            vm->gcPauseCount > 0 ? vm->gcPauseTotal / vm->gcPauseCount : 0.0);
+    fprintf(stderr, "[gc] %d minor collections, %zu bytes allocated young, %.1f%% survived, max pause %.3f ms\n",
+            vm->minorCount, vm->youngBytes,
+            vm->youngBytes > 0 ? 100.0 * vm->promotedBytes / vm->youngBytes : 0.0,
+            vm->minorPauseMax);
+    printPauseHistogram();
+}
+
+static void freeList(Obj* objects) {
     while(objects != NULL) {
         Obj* next = objects->next;
         freeObject(objects);
         objects = next;
     }
-}
\ No newline at end of file
+}
+
+void freeObjects() {
+    freeList(vm->objects);
+    freeList(vm->collector.unswept);
+    freeList(vm->collector.swept);
+    memset(&vm->collector, 0, sizeof(vm->collector));
+    vm->objects = NULL;
+    vm->gcMarking = false;
+
+    free(vm->grayStack);
+    vm->grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+}
@@ -1,37 +1,49 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "memory.h"
 #include "object.h"
+#include "symbols.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
 
 #define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjectType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+// Young objects are found by tracing, so they are on no list.
+static void linkObject(Obj* object, ObjectType type) {
 	object->type = type;
-	object->next = vm.objects;
-	vm.objects = object;
+	object->isMarked = false;
+	object->next = NULL;
+	if(isYoung(object)) return;
+	if(inRegion(object)) {
+		object->next = vm->regionObjects;
+		vm->regionObjects = object;
+	} else {
+		object->next = vm->objects;
+		vm->objects = object;
+	}
+}
+
+static Obj* allocateObject(size_t size, ObjectType type) {
+	Obj* object = (Obj*)allocateObjectMemory(size);
+	linkObject(object, type);
 	return object;
 }
 
-ObjString* allocateString(char* chars, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string->length = length;
-	string->chars = chars;
+static ObjString* registerString(ObjString* string, uint32_t hash) {
+	linkObject((Obj*)string, OBJ_STRING);
 	string->hash = hash;
-	tableSet(&vm.strings, string, NIL_VAL);
+
+	// Growing vm->strings can trigger a collection; keep the new string reachable.
+	push(OBJ_VAL(string));
+	tableSet(&vm->strings, string, NIL_VAL);
+	pop();
+	rememberInterned(string);
 	return string;
 }
 
 
-ObjString* takeString(char* chars, int length) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->chars = chars;
-    string->length = length;
-    return string;
-}
 static uint32_t hashString(const char* key, int length) {
 	uint32_t hash = 2166136261u;
 	for(int i = 0; i < length; i++) {
@@ -41,27 +53,204 @@ static uint32_t hashString(const char* key, int length) {
 	return hash;
 }
 
+ObjString* reserveString(int length) {
+	ObjString* string = (ObjString*)allocateObjectMemory(STRING_SIZE(length));
+	// A young block needs a valid header even if it is never interned.
+	string->obj.type = OBJ_STRING;
+	string->obj.isMarked = false;
+	string->length = length;
+	string->chars[length] = '\0';
+	return string;
+}
+
+// This VM's own copy of chars comes first, so a string it interned before
+// another isolate published the same symbol stays the only one it sees.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+	if(interned != NULL) {
+		retainInterned(interned);
+		return interned;
+	}
+	return sharedSymbols ? findSymbol(chars, length, hash) : NULL;
+}
+
+// Strings are always interned so that equality can stay a pointer compare.
+ObjString* internString(ObjString* string) {
+	uint32_t hash = hashString(string->chars, string->length);
+	ObjString* interned = findInterned(string->chars, string->length, hash);
+	if(interned != NULL) {
+		reallocate(string, STRING_SIZE(string->length), 0);
+		return interned;
+	}
+
+	return registerString(string, hash);
+}
+
+// A frozen string is permanently marked and on no VM's object list, so no
+// collector ever writes to it, frees it or moves it.
+ObjString* adoptString(ObjString* frozen) {
+	ObjString* interned = findInterned(frozen->chars, frozen->length, frozen->hash);
+	if(interned != NULL) return interned;
+
+	tableSet(&vm->strings, frozen, NIL_VAL);
+	return frozen;
+}
+
 ObjString* copyString(const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
+	ObjString* interned = findInterned(chars, length, hash);
+	if(interned != NULL) return interned;
 
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString* string = reserveString(length);
+	memcpy(string->chars, chars, length);
+	return registerString(string, hash);
+}
 
+ObjString* copySymbol(const char* chars, int length) {
+	if(!sharedSymbols) return copyString(chars, length);
+	uint32_t hash = hashString(chars, length);
+	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 	if(interned != NULL) {
+		retainInterned(interned);
 		return interned;
 	}
 
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
+	ObjString* symbol = internSymbol(chars, length, hash);
+	if(symbol != NULL) return symbol;
+	ObjString* string = reserveString(length);
+	memcpy(string->chars, chars, length);
+	return registerString(string, hash);
+}
+
+ObjRope* newRope(Obj* left, Obj* right, int length) {
+	ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = left;
+	rope->right = right;
+	rope->flat = NULL;
+	writeBarrier((Obj*)rope, left);
+	writeBarrier((Obj*)rope, right);
+	return rope;
+}
+
+// Natives and channel handles are never young or in the request region:
+// objects there die without freeObject(), which releases the channel.
+static Obj* allocatePinnedObject(size_t size, ObjectType type) {
+	Obj* object = (Obj*)allocatePinnedMemory(size);
+	linkObject(object, type);
+	return object;
+}
+
+ObjNative* newNative(NativeFn function, int arity) {
+	ObjNative* native = (ObjNative*)allocatePinnedObject(sizeof(ObjNative), OBJ_NATIVE);
+	native->function = function;
+	native->arity = arity;
+	return native;
+}
+
+ObjChannel* newChannelHandle(Channel* channel) {
+	ObjChannel* handle = (ObjChannel*)allocatePinnedObject(sizeof(ObjChannel), OBJ_CHANNEL);
+	handle->channel = channel;
+	return handle;
+}
 
-	return allocateString(heapChars, length, hash);
+int textLength(Obj* text) {
+	if(text->type == OBJ_STRING) return ((ObjString*)text)->length;
+	return ((ObjRope*)text)->length;
 }
 
+// Leaves of a rope that still has them; an already flattened rope counts
+// as a leaf.
+static ObjString* leafString(Obj* node) {
+	if(node->type == OBJ_STRING) return (ObjString*)node;
+	return ((ObjRope*)node)->flat;
+}
+
+// Appending builds left-deep ropes, so walk with an explicit stack rather
+// than recursing once per append.
+typedef struct {
+	Obj** nodes;
+	int count;
+	int capacity;
+} NodeStack;
+
+static void pushNode(NodeStack* stack, Obj* node) {
+	if(stack->count == stack->capacity) {
+		stack->capacity = GROW_CAPACITY(stack->capacity);
+		stack->nodes = realloc(stack->nodes, sizeof(Obj*) * stack->capacity);
+		if(stack->nodes == NULL) exit(1);
+	}
+	stack->nodes[stack->count++] = node;
+}
+
+ObjString* flattenText(Obj* text) {
+	if(text->type == OBJ_STRING) return (ObjString*)text;
+	ObjRope* rope = (ObjRope*)text;
+	if(rope->flat != NULL) return rope->flat;
+
+	ObjString* flat = reserveString(rope->length);
+	char* chars = flat->chars;
+
+	// Fill from the end: popping the right child first keeps the stack
+	// shallow for left-deep ropes.
+	NodeStack stack = {NULL, 0, 0};
+	int end = rope->length;
+	pushNode(&stack, text);
+	while(stack.count > 0) {
+		Obj* node = stack.nodes[--stack.count];
+		ObjString* leaf = leafString(node);
+		if(leaf == NULL) {
+			pushNode(&stack, ((ObjRope*)node)->left);
+			pushNode(&stack, ((ObjRope*)node)->right);
+			continue;
+		}
+		end -= leaf->length;
+		memcpy(chars + end, leaf->chars, leaf->length);
+	}
+	free(stack.nodes);
+
+	flat = internString(flat);
+	// A heap rope must not point into the request region, which goes
+	// away; it stays unflattened instead.
+	if(inRegion(flat) && !inRegion(rope)) return flat;
+	rope->flat = flat;
+	writeBarrier((Obj*)rope, (Obj*)flat);
+	rope->left = NULL;
+	rope->right = NULL;
+	return flat;
+}
+
+// Streams the leaves in order; printing never needs the rope flattened,
+// which would allocate.
+static void printRope(ObjRope* rope) {
+	NodeStack stack = {NULL, 0, 0};
+	pushNode(&stack, (Obj*)rope);
+	while(stack.count > 0) {
+		Obj* node = stack.nodes[--stack.count];
+		ObjString* leaf = leafString(node);
+		if(leaf == NULL) {
+			pushNode(&stack, ((ObjRope*)node)->right);
+			pushNode(&stack, ((ObjRope*)node)->left);
+			continue;
+		}
+		fwrite(leaf->chars, 1, leaf->length, vm->out);
+	}
+	free(stack.nodes);
+}
 
 void printObject(Value value) {
 	switch(OBJ_TYPE(value)) {
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			fputs(AS_CSTRING(value), vm->out);
+			break;
+		case OBJ_ROPE:
+			printRope(AS_ROPE(value));
+			break;
+		case OBJ_NATIVE:
+			fputs("<native fn>", vm->out);
+			break;
+		case OBJ_CHANNEL:
+			fputs("<channel>", vm->out);
 			break;
 	}
 }
\ No newline at end of file
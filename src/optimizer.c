@@ -0,0 +1,351 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+
+int optimizeLevel = 2;
+
+// Jumps are threaded through at most this many hops, which also stops
+// us from chasing a jump that loops back onto itself.
+#define MAX_THREAD_HOPS 16
+
+typedef struct {
+    uint8_t op;
+    int offset;
+    int length;
+    int line;
+    int target;     // instruction index a jump lands on, -1 otherwise
+    uint8_t operands[4]; // operand bytes, less any trailing jump offset
+    bool isTarget;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    int count;
+    int capacity;
+    Arena* scratch;  // everything here dies with optimizeChunk()
+} InstrList;
+
+// Every jump keeps its 16-bit offset in its last two bytes.
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+           op == OP_LESS_LOCAL_CONST_JUMP || op == OP_FOR_NUM_PREP || op == OP_FOR_NUM_LOOP;
+}
+
+static bool isBackwardJump(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_NUM_LOOP;
+}
+
+static bool isUnconditionalJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+// Instructions that push one value and have no other effect.
+static bool isPurePush(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int jumpTargetOffset(Chunk* chunk, Instruction* instruction) {
+    uint8_t* operand = &chunk->code[instruction->offset + instruction->length - 2];
+    int jump = (operand[0] << 8) | operand[1];
+    int next = instruction->offset + instruction->length;
+    return isBackwardJump(instruction->op) ? next - jump : next + jump;
+}
+
+static void decode(Chunk* chunk, InstrList* list) {
+    list->capacity = chunk->count + 1;
+    list->code = ARENA_ALLOCATE(list->scratch, Instruction, list->capacity);
+    list->count = 0;
+
+    // Offset -> instruction index, so jump operands can be resolved.
+    int* indexOf = ARENA_ALLOCATE(list->scratch, int, chunk->count + 1);
+
+    int run = 0;
+    int runEnd = chunk->lineCount > 0 ? chunk->lines[0].second : 0;
+    for(int offset = 0; offset < chunk->count;) {
+        while(offset >= runEnd && run + 1 < chunk->lineCount) {
+            run++;
+            runEnd += chunk->lines[run].second;
+        }
+
+        Instruction* instruction = &list->code[list->count];
+        instruction->op = chunk->code[offset];
+        instruction->offset = offset;
+        instruction->length = instructionLength(instruction->op);
+        instruction->line = chunk->lines[run].first;
+        instruction->target = -1;
+        instruction->isTarget = false;
+        instruction->removed = false;
+
+        int operandCount = instruction->length - 1 - (isJump(instruction->op) ? 2 : 0);
+        for(int i = 0; i < operandCount; i++) {
+            instruction->operands[i] = chunk->code[offset + 1 + i];
+        }
+
+        for(int i = 0; i < instruction->length; i++) indexOf[offset + i] = list->count;
+        offset += instruction->length;
+        list->count++;
+    }
+    indexOf[chunk->count] = list->count;
+
+    for(int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if(isJump(instruction->op)) {
+            instruction->target = indexOf[jumpTargetOffset(chunk, instruction)];
+        }
+    }
+}
+
+static int nextLive(InstrList* list, int index) {
+    while(index < list->count && list->code[index].removed) index++;
+    return index;
+}
+
+// Redirects jumps whose target is itself a jump that will certainly be
+// taken: an unconditional jump always is, and a conditional jump landing
+// on another OP_JUMP_IF_FALSE sees the same, still falsey, condition.
+static bool threadJumps(InstrList* list) {
+    bool changed = false;
+    for(int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if(instruction->removed || !isJump(instruction->op)) continue;
+
+        for(int hops = 0; hops < MAX_THREAD_HOPS; hops++) {
+            int target = nextLive(list, instruction->target);
+            if(target >= list->count || target == i) break;
+
+            Instruction* next = &list->code[target];
+            bool follow = isUnconditionalJump(next->op) ||
+                (instruction->op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_FALSE);
+            if(!follow || next->target == target) break;
+
+            // Conditional jumps cannot change direction.
+            if(!isUnconditionalJump(instruction->op) &&
+               (next->target <= i) != isBackwardJump(instruction->op)) break;
+            // Layout only shrinks, so the old distance bounds the new one.
+            int from = instruction->offset + instruction->length;
+            int to = next->target < list->count ? list->code[next->target].offset
+                                                    : list->code[list->count - 1].offset + 1;
+            if(abs(to - from) > UINT16_MAX) break;
+
+            instruction->target = next->target;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void markTargets(InstrList* list) {
+    for(int i = 0; i < list->count; i++) list->code[i].isTarget = false;
+    for(int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if(instruction->removed || instruction->target == -1) continue;
+
+        int target = nextLive(list, instruction->target);
+        if(target < list->count) list->code[target].isTarget = true;
+    }
+}
+
+static bool rewritePairs(InstrList* list) {
+    bool changed = false;
+    for(int i = nextLive(list, 0); i < list->count; i = nextLive(list, i + 1)) {
+        Instruction* first = &list->code[i];
+
+        // A jump to the very next instruction does nothing.
+        if(first->op == OP_JUMP && nextLive(list, first->target) == nextLive(list, i + 1)) {
+            first->removed = true;
+            changed = true;
+            continue;
+        }
+
+        int j = nextLive(list, i + 1);
+        if(j >= list->count) break;
+        Instruction* second = &list->code[j];
+        // Something else jumps between the two; they cannot be merged.
+        if(second->isTarget) continue;
+
+        uint8_t fused = 0;
+        if(second->op == OP_NOT) {
+            if(first->op == OP_EQUAL) fused = OP_NOT_EQUAL;
+            if(first->op == OP_LESS) fused = OP_GREATER_EQUAL;
+            if(first->op == OP_GREATER) fused = OP_LESS_EQUAL;
+        } else if(second->op == OP_POP) {
+            if(first->op == OP_SET_LOCAL) {
+                fused = OP_SET_LOCAL_POP;
+            } else if(isPurePush(first->op)) {
+                first->removed = true;
+                second->removed = true;
+                changed = true;
+                continue;
+            }
+        }
+
+        if(fused != 0) {
+            first->op = fused;
+            second->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Returns the index of the live instruction count steps after index, or
+// -1 if the run is cut short, anything but its first instruction is a
+// jump target, or the run spans lines. A superinstruction reports errors
+// at one line, so fusing across lines would misplace them.
+static int liveRun(InstrList* list, int index, int count, int* run) {
+    run[0] = index;
+    for(int k = 1; k < count; k++) {
+        int next = nextLive(list, run[k - 1] + 1);
+        if(next >= list->count || list->code[next].isTarget) return -1;
+        if(list->code[next].line != list->code[index].line) return -1;
+        run[k] = next;
+    }
+    return run[count - 1];
+}
+
+static void fuse(InstrList* list, int* run, int count, uint8_t op) {
+    list->code[run[0]].op = op;
+    for(int k = 1; k < count; k++) list->code[run[k]].removed = true;
+}
+
+// Replaces the hottest instruction sequences with superinstructions:
+//   GET_LOCAL a, CONSTANT k, ADD, SET_LOCAL_POP a   -> INC_LOCAL_CONST a k
+//   GET_LOCAL a, CONSTANT k, LESS, JUMP_IF_FALSE, POP
+//                                                   -> LESS_LOCAL_CONST_JUMP a k
+//   GET_LOCAL a, GET_LOCAL b                        -> GET_LOCAL_GET_LOCAL a b
+// The fused jump lands past the POP its false branch used to jump to, so
+// that target must be a POP.
+static bool fuseSuperinstructions(InstrList* list) {
+    bool changed = false;
+    for(int i = nextLive(list, 0); i < list->count; i = nextLive(list, i + 1)) {
+        Instruction* first = &list->code[i];
+        if(first->op != OP_GET_LOCAL) continue;
+
+        int run[5];
+        Instruction* code = list->code;
+        if(liveRun(list, i, 4, run) != -1 && code[run[1]].op == OP_CONSTANT &&
+           code[run[2]].op == OP_ADD && code[run[3]].op == OP_SET_LOCAL_POP &&
+           code[run[3]].operands[0] == first->operands[0]) {
+            first->operands[1] = code[run[1]].operands[0];
+            fuse(list, run, 4, OP_INC_LOCAL_CONST);
+            changed = true;
+            continue;
+        }
+
+        if(liveRun(list, i, 5, run) != -1 && code[run[1]].op == OP_CONSTANT &&
+           code[run[2]].op == OP_LESS && code[run[3]].op == OP_JUMP_IF_FALSE &&
+           code[run[4]].op == OP_POP) {
+            int exit = nextLive(list, code[run[3]].target);
+            if(exit < list->count && code[exit].op == OP_POP) {
+                first->operands[1] = code[run[1]].operands[0];
+                first->target = nextLive(list, exit + 1);
+                fuse(list, run, 5, OP_LESS_LOCAL_CONST_JUMP);
+                changed = true;
+                continue;
+            }
+        }
+
+        if(liveRun(list, i, 2, run) != -1 && code[run[1]].op == OP_GET_LOCAL) {
+            first->operands[1] = code[run[1]].operands[0];
+            fuse(list, run, 2, OP_GET_LOCAL_GET_LOCAL);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void emitJumpOperand(Chunk* chunk, int jump, int line) {
+    writeChunk(chunk, (jump >> 8) & 0xff, line);
+    writeChunk(chunk, jump & 0xff, line);
+}
+
+// Re-encodes the surviving instructions into chunk, which keeps its
+// constant pool. Lines are rebuilt as the code is written.
+static void relayout(Chunk* chunk, InstrList* list) {
+    int* newOffset = ARENA_ALLOCATE(list->scratch, int, list->count + 1);
+    int offset = 0;
+    for(int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        newOffset[i] = offset;
+        if(instruction->removed) continue;
+        instruction->length = instructionLength(instruction->op);
+        offset += instruction->length;
+    }
+    newOffset[list->count] = offset;
+    // Removed instructions resolve to whatever comes after them.
+    for(int i = list->count - 1; i >= 0; i--) {
+        if(list->code[i].removed) newOffset[i] = newOffset[i + 1];
+    }
+
+    Chunk rewritten;
+    initChunk(&rewritten);
+    for(int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if(instruction->removed) continue;
+
+        uint8_t op = instruction->op;
+        int from = newOffset[i] + instruction->length;
+        int to = isJump(op) ? newOffset[instruction->target] : 0;
+        if(isUnconditionalJump(op)) op = to < from ? OP_LOOP : OP_JUMP;
+
+        writeChunk(&rewritten, op, instruction->line);
+        int operandCount = instruction->length - 1 - (isJump(op) ? 2 : 0);
+        for(int k = 0; k < operandCount; k++) {
+            writeChunk(&rewritten, instruction->operands[k], instruction->line);
+        }
+        if(isJump(op)) {
+            emitJumpOperand(&rewritten, isBackwardJump(op) ? from - to : to - from, instruction->line);
+        }
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(intPair, chunk->lines, chunk->lineCapacity);
+
+    chunk->code = rewritten.code;
+    chunk->count = rewritten.count;
+    chunk->capacity = rewritten.capacity;
+    chunk->lines = rewritten.lines;
+    chunk->lineCount = rewritten.lineCount;
+    chunk->lineCapacity = rewritten.lineCapacity;
+    freeValueArray(&rewritten.constants);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    if(optimizeLevel < 1 || chunk->count == 0) return;
+
+    Arena scratch;
+    initArena(&scratch);
+    InstrList list;
+    list.scratch = &scratch;
+    decode(chunk, &list);
+
+    bool changed = false;
+    for(;;) {
+        bool pass = threadJumps(&list);
+        markTargets(&list);
+        pass |= rewritePairs(&list);
+        if(!pass) break;
+        changed = true;
+    }
+
+    if(optimizeLevel >= 2) {
+        markTargets(&list);
+        changed |= fuseSuperinstructions(&list);
+    }
+
+    if(changed) relayout(chunk, &list);
+    freeArena(&scratch);
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "object.h"
+#include "program.h"
+#include "table.h"
+#include "vm.h"
+
+// A program is one anonymous mapping, made read-only once it is filled:
+//   Program | code | line runs | constants | global names | strings
+// Its strings are ObjStrings like any other, but frozen: permanently
+// marked and on no VM's object list, so no collector writes to them,
+// frees them or moves them, and every VM running the program can intern
+// them as they are.
+struct Program {
+    size_t size;
+    int count;
+    uint8_t* code;
+    int lineCount;
+    intPair* lines;
+    uint32_t constantCount;
+    Value* constants;
+    // Names in the slot order the code was compiled against.
+    uint32_t globalCount;
+    ObjString** globals;
+    // Distinct frozen strings, so a VM can grow its intern table once.
+    int strings;
+};
+
+#define PROGRAM_ALIGN 8
+
+static size_t alignSize(size_t size) {
+    return (size + PROGRAM_ALIGN - 1) & ~(size_t)(PROGRAM_ALIGN - 1);
+}
+
+static void* take(char** cursor, size_t size) {
+    void* block = *cursor;
+    *cursor += alignSize(size);
+    return block;
+}
+
+// Counts string once, keyed by the compiling VM's interned copy.
+static size_t stringBytes(Table* frozen, ObjString* string, int* strings) {
+    Value copy;
+    if(tableGet(frozen, string, &copy)) return 0;
+    tableSet(frozen, string, NIL_VAL);
+    (*strings)++;
+    return alignSize(STRING_SIZE(string->length));
+}
+
+static ObjString* freezeString(Table* frozen, char** cursor, ObjString* string) {
+    Value copy;
+    if(tableGet(frozen, string, &copy) && !IS_NIL(copy)) return AS_STRING(copy);
+
+    size_t size = STRING_SIZE(string->length);
+    ObjString* frozenString = (ObjString*)take(cursor, size);
+    memcpy(frozenString, string, size);
+    frozenString->obj.isMarked = true;
+    frozenString->obj.next = NULL;
+    tableSet(frozen, string, OBJ_VAL(frozenString));
+    return frozenString;
+}
+
+// The caller keeps chunk's constants marked.
+Program* freezeProgram(Chunk* chunk) {
+    Table frozen;
+    initTable(&frozen);
+    int strings = 0;
+    size_t size = alignSize(sizeof(Program)) + alignSize(chunk->count) +
+                  alignSize(sizeof(intPair) * chunk->lineCount) +
+                  alignSize(sizeof(Value) * chunk->constants.count) +
+                  alignSize(sizeof(ObjString*) * vm->globalNames.count);
+    for(uint32_t i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if(IS_STRING(constant)) size += stringBytes(&frozen, AS_STRING(constant), &strings);
+    }
+    for(uint32_t i = 0; i < vm->globalNames.count; i++) {
+        size += stringBytes(&frozen, AS_STRING(vm->globalNames.values[i]), &strings);
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED) exit(1);
+    char* cursor = (char*)mapping;
+    Program* program = (Program*)take(&cursor, sizeof(Program));
+    program->size = size;
+    program->strings = strings;
+
+    program->count = chunk->count;
+    program->code = (uint8_t*)take(&cursor, chunk->count);
+    memcpy(program->code, chunk->code, chunk->count);
+    program->lineCount = chunk->lineCount;
+    program->lines = (intPair*)take(&cursor, sizeof(intPair) * chunk->lineCount);
+    memcpy(program->lines, chunk->lines, sizeof(intPair) * chunk->lineCount);
+
+    program->constantCount = chunk->constants.count;
+    program->constants = (Value*)take(&cursor, sizeof(Value) * chunk->constants.count);
+    program->globalCount = vm->globalNames.count;
+    program->globals = (ObjString**)take(&cursor, sizeof(ObjString*) * vm->globalNames.count);
+    for(uint32_t i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if(IS_STRING(constant)) {
+            constant = OBJ_VAL(freezeString(&frozen, &cursor, AS_STRING(constant)));
+        }
+        program->constants[i] = constant;
+    }
+    for(uint32_t i = 0; i < vm->globalNames.count; i++) {
+        program->globals[i] = freezeString(&frozen, &cursor, AS_STRING(vm->globalNames.values[i]));
+    }
+
+    freeTable(&frozen);
+    // VMs on other threads share the program on the strength of this.
+    if(mprotect(mapping, size, PROT_READ) != 0) {
+        munmap(mapping, size);
+        exit(1);
+    }
+    return program;
+}
+
+void thawProgram(const Program* program, Chunk* chunk) {
+    chunk->code = program->code;
+    chunk->count = program->count;
+    chunk->capacity = program->count;
+    chunk->lines = program->lines;
+    chunk->lineCount = program->lineCount;
+    chunk->lineCapacity = program->lineCount;
+    chunk->readOnly = true;
+
+    tableReserve(&vm->strings, program->strings);
+    uint32_t count = program->globalCount;
+    int* slots = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+    if(slots == NULL) exit(1);
+    bool moved = false;
+    for(uint32_t i = 0; i < count; i++) {
+        slots[i] = globalSlot(adoptString(program->globals[i]));
+        if(slots[i] != (int)i) moved = true;
+    }
+    if(moved) remapGlobals(chunk, slots, count);
+    free(slots);
+
+    // Only the array is per run; a string constant is the frozen one
+    // unless this VM already had its own.
+    for(uint32_t i = 0; i < program->constantCount; i++) {
+        Value constant = program->constants[i];
+        if(IS_STRING(constant)) constant = OBJ_VAL(adoptString(AS_STRING(constant)));
+        addConstant(chunk, constant);
+    }
+}
+
+void potatoFreeProgram(Program* program) {
+    munmap(program, program->size);
+}
@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbols.h"
+
+// Open addressing with linear probing over a fixed power-of-two array.
+// A slot goes from NULL to a symbol exactly once, by compare-and-swap, and
+// the symbol is complete before it is published, so readers need no lock.
+// Nothing is ever removed, and the table never grows: once it is at its
+// load limit, new strings stay private to the VM that made them.
+//
+// Symbols are frozen, like a Program's strings: permanently marked and on
+// no VM's object list, so no collector writes to them or frees them.
+#define SYMBOL_CAPACITY (1 << 16)
+#define SYMBOL_LOAD_LIMIT (SYMBOL_CAPACITY / 4 * 3)
+
+bool sharedSymbols = false;
+
+static _Atomic(ObjString*)* symbols = NULL;
+static atomic_int symbolCount;
+static atomic_size_t symbolBytes;
+
+void initSymbols() {
+    symbols = (_Atomic(ObjString*)*)calloc(SYMBOL_CAPACITY, sizeof(*symbols));
+    if(symbols == NULL) exit(1);
+    atomic_init(&symbolCount, 0);
+    atomic_init(&symbolBytes, 0);
+    sharedSymbols = true;
+}
+
+void freeSymbols() {
+    if(symbols == NULL) return;
+    for(int i = 0; i < SYMBOL_CAPACITY; i++) free(atomic_load_explicit(&symbols[i], memory_order_relaxed));
+    free(symbols);
+    symbols = NULL;
+    sharedSymbols = false;
+}
+
+static bool symbolMatches(ObjString* symbol, const char* chars, int length, uint32_t hash) {
+    return symbol->hash == hash && symbol->length == length && memcmp(symbol->chars, chars, length) == 0;
+}
+
+ObjString* findSymbol(const char* chars, int length, uint32_t hash) {
+    for(uint32_t index = hash & (SYMBOL_CAPACITY - 1);; index = (index + 1) & (SYMBOL_CAPACITY - 1)) {
+        ObjString* symbol = atomic_load_explicit(&symbols[index], memory_order_acquire);
+        if(symbol == NULL) return NULL;
+        if(symbolMatches(symbol, chars, length, hash)) return symbol;
+    }
+}
+
+static ObjString* newSymbol(const char* chars, int length, uint32_t hash) {
+    ObjString* symbol = (ObjString*)malloc(STRING_SIZE(length));
+    if(symbol == NULL) exit(1);
+    symbol->obj.type = OBJ_STRING;
+    symbol->obj.isMarked = true;
+    symbol->obj.next = NULL;
+    symbol->length = length;
+    symbol->hash = hash;
+    memcpy(symbol->chars, chars, length);
+    symbol->chars[length] = '\0';
+    return symbol;
+}
+
+// The load limit keeps an empty slot on every probe sequence, even with
+// several threads racing past it at once.
+ObjString* internSymbol(const char* chars, int length, uint32_t hash) {
+    ObjString* created = NULL;
+    for(uint32_t index = hash & (SYMBOL_CAPACITY - 1);; index = (index + 1) & (SYMBOL_CAPACITY - 1)) {
+        ObjString* symbol = atomic_load_explicit(&symbols[index], memory_order_acquire);
+        if(symbol == NULL) {
+            if(atomic_load_explicit(&symbolCount, memory_order_relaxed) >= SYMBOL_LOAD_LIMIT) {
+                free(created);
+                return NULL;
+            }
+            if(created == NULL) created = newSymbol(chars, length, hash);
+            if(atomic_compare_exchange_strong_explicit(&symbols[index], &symbol, created,
+                                                       memory_order_acq_rel, memory_order_acquire)) {
+                atomic_fetch_add_explicit(&symbolCount, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&symbolBytes, STRING_SIZE(length), memory_order_relaxed);
+                return created;
+            }
+            // Lost the race; symbol is now whatever another thread published.
+        }
+        if(symbolMatches(symbol, chars, length, hash)) {
+            free(created);
+            return symbol;
+        }
+    }
+}
+
+void printSymbolStats() {
+    fprintf(stderr, "[symbols] %d shared strings, %zu bytes\n",
+            atomic_load(&symbolCount), atomic_load(&symbolBytes));
+}
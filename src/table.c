@@ -1,45 +1,121 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+// Grow once live entries plus tombstones pass 3/4 of the capacity.
+#define TABLE_MAX_LOAD_NUM 3
+#define TABLE_MAX_LOAD_DEN 4
+
+#define GROUP_WIDTH 16
+
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+// Each match function returns a bitmask with bit i set when control
+// byte i of the group satisfies the test.
+#ifdef __SSE2__
 
-#define TABLE_MAX_LOAD 0.75
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+}
+
+// EMPTY and DELETED are the only control bytes with the top bit set.
+static inline uint32_t matchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    uint32_t mask = 0;
+    for(int i = 0; i < GROUP_WIDTH; i++) {
+        if(group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {
+    uint32_t mask = 0;
+    for(int i = 0; i < GROUP_WIDTH; i++) {
+        if(group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+
+#endif
+
+static inline uint32_t matchEmpty(const uint8_t* group) {
+    return matchByte(group, CTRL_EMPTY);
+}
+
+static inline int lowestBit(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table* table) {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash %capacity;
-    Entry* tombstone = NULL;
-    for(;;) {
-        Entry* entry = &entries[index];
-        if(entry->key == NULL) {
-            if(IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if(tombstone == NULL) tombstone = entry;
-            }
-        }
-        if(entry->key == key) {
-            return entry;
+// Groups are probed triangularly (g, g+1, g+3, g+6, ...), which visits
+// every group once when the group count is a power of two. A lookup can
+// stop at the first group with an EMPTY byte: inserts never skip past one.
+static int findIndex(uint8_t* control, Entry* entries, int capacity, ObjString* key) {
+    uint32_t groupMask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+    uint32_t group = H1(key->hash) & groupMask;
+    uint8_t h2 = H2(key->hash);
+
+    for(uint32_t step = 1;; step++) {
+        uint8_t* ctrl = control + group * GROUP_WIDTH;
+        uint32_t candidates = matchByte(ctrl, h2);
+        while(candidates != 0) {
+            int index = (int)(group * GROUP_WIDTH) + lowestBit(candidates);
+            if(entries[index].key == key) return index;
+            candidates &= candidates - 1;
         }
-        index = (index + 1) % capacity;
+        if(matchEmpty(ctrl) != 0) return -1;
+        group = (group + step) & groupMask;
+    }
+}
+
+// First EMPTY or DELETED slot on key's probe sequence.
+static int findFreeIndex(uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t groupMask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+    uint32_t group = H1(hash) & groupMask;
+
+    for(uint32_t step = 1;; step++) {
+        uint32_t available = matchFree(control + group * GROUP_WIDTH);
+        if(available != 0) return (int)(group * GROUP_WIDTH) + lowestBit(available);
+        group = (group + step) & groupMask;
     }
 }
 
 static void resizeTable(Table* table, int capacity) {
+    uint8_t* control = ALLOCATE(uint8_t, capacity);
     Entry* entries = ALLOCATE(Entry, capacity);
+    memset(control, CTRL_EMPTY, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -50,35 +126,66 @@ static void resizeTable(Table* table, int capacity) {
         Entry* entry = &table->entries[i];
         if(entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int index = findFreeIndex(control, capacity, entry->key->hash);
+        control[index] = H2(entry->key->hash);
+        entries[index] = *entry;
         table->count++;
     }
 
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
-  
+
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
+    // Write barrier: the table may already have been marked this cycle.
+    if(vm->gcMarking) {
+        markObject((Obj*)key);
+        markValue(value);
+    }
 
-    if(table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if(table->capacity > 0) {
+        int index = findIndex(table->control, table->entries, table->capacity, key);
+        if(index != -1) {
+            table->entries[index].value = value;
+            return false;
+        }
+    }
+
+    if((table->count + table->tombstones + 1) * TABLE_MAX_LOAD_DEN >
+       table->capacity * TABLE_MAX_LOAD_NUM) {
+        // Double unless most of the load is tombstones, in which case
+        // rehashing at the same capacity clears them.
+        int capacity = table->capacity;
+        if(capacity < GROUP_WIDTH) {
+            capacity = GROUP_WIDTH;
+        } else if(table->count * 2 >= table->capacity) {
+            capacity *= 2;
+        }
         resizeTable(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = (entry->key == NULL);
-    if(isNewKey && IS_NIL(entry->value)) table->count++;
+    int index = findFreeIndex(table->control, table->capacity, key->hash);
+    if(table->control[index] == CTRL_DELETED) table->tombstones--;
+    table->control[index] = H2(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+void tableReserve(Table* table, int count) {
+    int needed = table->count + table->tombstones + count;
+    int capacity = table->capacity < GROUP_WIDTH ? GROUP_WIDTH : table->capacity;
+    while(needed * TABLE_MAX_LOAD_DEN > capacity * TABLE_MAX_LOAD_NUM) capacity *= 2;
+    if(capacity > table->capacity) resizeTable(table, capacity);
 }
 
-void tableAndAll(Table* from, Table* to) {
+void tableAddAll(Table* from, Table* to) {
     for(int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if(entry->key != NULL) {
@@ -89,36 +196,62 @@ void tableAndAll(Table* from, Table* to) {
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if(table->count == 0) return false;
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if(entry->key == NULL) return false;
+    int index = findIndex(table->control, table->entries, table->capacity, key);
+    if(index == -1) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
+static void removeIndex(Table* table, int index) {
+    // A slot can go straight back to EMPTY when its group still has an
+    // EMPTY byte: no probe sequence ever continued past this group.
+    uint8_t* group = table->control + (index & ~(GROUP_WIDTH - 1));
+    if(matchEmpty(group) != 0) {
+        table->control[index] = CTRL_EMPTY;
+    } else {
+        table->control[index] = CTRL_DELETED;
+        table->tombstones++;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+}
+
 bool tableDelete(Table* table, ObjString* key) {
     if(table->count == 0) return false;
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if(entry->key == NULL) return false;
+    int index = findIndex(table->control, table->entries, table->capacity, key);
+    if(index == -1) return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
-    return true; 
+    removeIndex(table, index);
+    return true;
+}
+
+void tableRekey(Table* table, ObjString* key, ObjString* to) {
+    if(table->count == 0) return;
+    int index = findIndex(table->control, table->entries, table->capacity, key);
+    if(index != -1) table->entries[index].key = to;
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if(table->count == 0) return NULL;
-    uint32_t index = hash % table->capacity;
 
-    for(;;) {
-        Entry* entry = &table->entries[index];
+    uint32_t groupMask = (uint32_t)(table->capacity / GROUP_WIDTH) - 1;
+    uint32_t group = H1(hash) & groupMask;
+    uint8_t h2 = H2(hash);
 
-        if(entry->key == NULL) {
-            if(IS_NIL(entry->value)) return NULL;
-        } else if(entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    for(uint32_t step = 1;; step++) {
+        uint8_t* ctrl = table->control + group * GROUP_WIDTH;
+        uint32_t candidates = matchByte(ctrl, h2);
+        while(candidates != 0) {
+            ObjString* key = table->entries[group * GROUP_WIDTH + lowestBit(candidates)].key;
+            if(key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
+            candidates &= candidates - 1;
         }
-
-        index = (index + 1) % table->capacity;
+        if(matchEmpty(ctrl) != 0) return NULL;
+        group = (group + step) & groupMask;
     }
 }
@@ -4,6 +4,7 @@
 #include "object.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void initValueArray(ValueArray* array) {
 	array->values = NULL;
@@ -26,37 +27,55 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
-	switch (value.type) {
-	case VAL_BOOL:
-		printf(AS_BOOL(value) ? "true": "false");
-		break;
-	case VAL_NIL:
-		printf("nil");
-		break;
-	case VAL_NUMBER:
-		printf("%g", AS_NUMBER(value));
-		break;
-	case VAL_OBJ:
+	if (IS_BOOL(value)) {
+		fputs(AS_BOOL(value) ? "true": "false", vm->out);
+	} else if (IS_NIL(value)) {
+		fputs("nil", vm->out);
+	} else if (IS_NUMBER(value)) {
+		fprintf(vm->out, "%g", AS_NUMBER(value));
+	} else if (IS_OBJ(value)) {
 		printObject(value);
-		break;
 	}
 }
 
 static Value typecastToNumber(Value value) {
-	switch (value.type) {
-		case VAL_NUMBER: return value;
-		case VAL_BOOL: return NUMBER_VAL((double)value.as.boolean);
-		case VAL_NIL: return NUMBER_VAL((double)value.as.number);
-		default: return NIL_VAL;
-	}
+	if (IS_NUMBER(value)) return value;
+	if (IS_BOOL(value)) return NUMBER_VAL((double)AS_BOOL(value));
+	if (IS_NIL(value)) return NUMBER_VAL(0);
+	return NIL_VAL;
+}
+
+// Interned strings are equal exactly when they are the same object; a rope
+// has to be flattened to its interned string first, so both values must
+// be reachable from a root.
+static bool textEqual(Obj* text1, Obj* text2) {
+	if (text1 == text2) return true;
+	if (text1->type > OBJ_ROPE || text2->type > OBJ_ROPE) return false;
+	if (textLength(text1) != textLength(text2)) return false;
+	if (text1->type == OBJ_STRING && text2->type == OBJ_STRING) return false;
+	return flattenText(text1) == flattenText(text2);
 }
 
 bool valuesEqual(Value value1, Value value2) {
+#ifdef NAN_BOXING
+	// Numbers go through the double compare so NaN != NaN and 0 == -0;
+	// everything else is equal exactly when the bits are.
+	if (IS_NUMBER(value1) && IS_NUMBER(value2)) {
+		return AS_NUMBER(value1) == AS_NUMBER(value2);
+	}
+	if (IS_OBJ(value1) && IS_OBJ(value2)) {
+		return textEqual(AS_OBJ(value1), AS_OBJ(value2));
+	}
+	return value1 == value2;
+#else
+	if (value1.type != value2.type) return false;
 	switch (value1.type) {
 		case VAL_BOOL:   return AS_BOOL(value1) == AS_BOOL(value2);
 		case VAL_NIL:    return true;
+		case VAL_UNDEFINED: return true;
 		case VAL_NUMBER: return AS_NUMBER(value1) == AS_NUMBER(value2);
-		case VAL_OBJ: return AS_OBJ(value1) == AS_OBJ(value2);
+		case VAL_OBJ: return textEqual(AS_OBJ(value1), AS_OBJ(value2));
 		default:         return false;
 	}
-}
\ No newline at end of file
+#endif
+}
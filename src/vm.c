@@ -1,282 +1,981 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
 
+#include "bytecode.h"
+#include "channel.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
+#include "program.h"
 #include "vm.h"
 #include "memory.h"
 
-VM vm;
+_Thread_local VM* vm = NULL;
+
+#ifdef DEBUG_COUNT_PAIRS
+static uint64_t pairCounts[UINT8_COUNT][UINT8_COUNT];
+
+// One "pair <first> <second> <count>" line per executed pair, for
+// tools/oppairs.sh to sum over a corpus.
+static void dumpOpcodePairs() {
+    for(int first = 0; first < UINT8_COUNT; first++) {
+        for(int second = 0; second < UINT8_COUNT; second++) {
+            if(pairCounts[first][second] == 0) continue;
+            fprintf(stderr, "pair %s %s %llu\n", opcodeName(first), opcodeName(second),
+                    (unsigned long long)pairCounts[first][second]);
+        }
+    }
+}
+#endif
 
 static void resetStack() {
-    vm.sp = vm.stack;
-    vm.objects = NULL;
+    vm->sp = vm->stack;
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    size_t intsruction = vm.ip - vm.chunk->code - 1;
-    int line = getLine(vm.chunk, intsruction);
-    fprintf(stderr, "[Line %d] in script", line);
+    size_t intsruction = vm->ip - vm->chunk->code - 1;
+    int line = getLine(vm->chunk, intsruction);
+    fprintf(vm->err, "[Line %d] in script\n", line);
     resetStack();
 }
 
 void push(Value value) {
-    *vm.sp = value;
-    vm.sp++;
+    *vm->sp = value;
+    vm->sp++;
 }
 
 Value pop() {
-    vm.sp--;
-    return *vm.sp;
+    vm->sp--;
+    return *vm->sp;
+}
+
+VM* bindVM(VM* isolate) {
+    VM* previous = vm;
+    vm = isolate;
+    return previous;
+}
+
+// Defines a global before any chunk runs, while the slot array may still
+// grow.
+static void defineGlobal(const char* name, Value value) {
+    push(value);
+    int slot = globalSlot(copyString(name, (int)strlen(name)));
+    vm->globalValues.values[slot] = pop();
 }
 
-static Value peek(int distance) {
-  return vm.sp[-1 - distance];
+static void defineNative(const char* name, NativeFn function, int arity) {
+    defineGlobal(name, OBJ_VAL(newNative(function, arity)));
 }
 
-void initVM() {
+static void defineNatives() {
+    defineNative("channel", channelNative, 1);
+    defineNative("send", sendNative, 2);
+    defineNative("trySend", trySendNative, 2);
+    defineNative("receive", receiveNative, 1);
+    defineNative("tryReceive", tryReceiveNative, 1);
+}
+
+// Allocator and collector state starts out zeroed.
+VM* potatoNewVM() {
+    VM* isolate = (VM*)calloc(1, sizeof(VM));
+    if(isolate == NULL) exit(1);
+    VM* previous = bindVM(isolate);
+
     resetStack();
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->chunk = NULL;
+    vm->objects = NULL;
+    vm->regionObjects = NULL;
+    vm->arenaMode = false;
+    vm->nurserySize = 256 * 1024;
+    vm->nurseryFull = false;
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->gcPauseBudget = 0;
+    vm->gcMarking = false;
+
+    vm->gcStats = false;
+    vm->allocStats = false;
+    vm->gcCount = 0;
+    vm->gcBytesFreed = 0;
+    vm->gcPauseCount = 0;
+    vm->gcPauseTotal = 0;
+    vm->gcPauseMax = 0;
+    memset(vm->gcPauseHistogram, 0, sizeof(vm->gcPauseHistogram));
+    vm->minorCount = 0;
+    vm->youngBytes = 0;
+    vm->promotedBytes = 0;
+    vm->minorPauseMax = 0;
+
+    initTable(&vm->strings);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    defineNatives();
+
+    bindVM(previous);
+    return isolate;
 }
 
-void exitVM() {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
+void potatoResetVM(VM* isolate) {
+    VM* previous = bindVM(isolate);
+    freeTable(&vm->strings);
+    freeTable(&vm->globalSlots);
+    freeValueArray(&vm->globalNames);
+    freeValueArray(&vm->globalValues);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
     freeObjects();
+    resetNursery();
+    resetStack();
+    vm->nextGC = 1024 * 1024;
+    defineNatives();
+    bindVM(previous);
 }
 
-static bool isFalsey(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)) || (IS_NUMBER(value) && AS_NUMBER(value) == 0);
+void potatoFreeVM(VM* isolate) {
+    VM* previous = bindVM(isolate);
+    freeTable(&vm->strings);
+    freeTable(&vm->globalSlots);
+    freeValueArray(&vm->globalNames);
+    freeValueArray(&vm->globalValues);
+    if(vm->gcStats) printGCStats();
+    if(vm->allocStats) printAllocStats();
+#ifdef DEBUG_COUNT_PAIRS
+    dumpOpcodePairs();
+#endif
+    freeObjects();
+    freeNursery();
+    freePool();
+    freeRegion();
+#ifdef JIT
+    jitFreeTracer();
+#endif
+
+    bindVM(previous == isolate ? NULL : previous);
+    free(isolate);
 }
 
-static Value concatenate(Value string1, Value string2) {
-    ObjString* a = AS_STRING(string1);
-    ObjString* b = AS_STRING(string2);
+// Returns the slot for a global name, handing out a new undefined one the
+// first time the name is seen. Slots are never reused, so code compiled on
+// an earlier REPL line keeps working.
+int globalSlot(ObjString* name) {
+    Value slot;
+    if(tableGet(&vm->globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    int index = (int)vm->globalValues.count;
+    push(OBJ_VAL(name));
+    tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+    writeValueArray(&vm->globalNames, OBJ_VAL(name));
+    writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+    pop();
+    return index;
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Concatenations at least this long are deferred into a rope.
+#define ROPE_MIN_LENGTH 64
 
-    ObjString* result = takeString(chars, length);
-    return OBJ_VAL(result);
+// Adds part to the running length of a text, reporting a runtime error if
+// the total would not fit a string's length.
+static bool addLength(int* length, int part) {
+    if(part > INT_MAX - *length) {
+        runtimeError("String too long");
+        return false;
+    }
+    *length += part;
+    return true;
+}
+
+// Both operands must still be on the stack: the allocations below can collect.
+// Short results are copied and interned right away; longer ones become a
+// rope, so building a string by repeated appends stays linear.
+bool concatenate(Value string1, Value string2, Value* result) {
+    int length = textLength(AS_OBJ(string1));
+    if(!addLength(&length, textLength(AS_OBJ(string2)))) return false;
+    if(length >= ROPE_MIN_LENGTH) {
+        *result = OBJ_VAL(newRope(AS_OBJ(string1), AS_OBJ(string2), length));
+        return true;
+    }
+
+    // Anything this short is a string or an already flattened rope, so
+    // neither call allocates.
+    ObjString* a = flattenText(AS_OBJ(string1));
+    ObjString* b = flattenText(AS_OBJ(string2));
+    ObjString* joined = reserveString(length);
+    memcpy(joined->chars, a->chars, a->length);
+    memcpy(joined->chars + a->length, b->chars, b->length);
+    *result = OBJ_VAL(internString(joined));
+    return true;
+}
+
+// Copies short texts into one new string; none of them can be an
+// unflattened rope, so the string is the only allocation.
+static ObjString* joinTexts(Value* texts, int count, int length) {
+    ObjString* result = reserveString(length);
+    int at = 0;
+    for(int i = 0; i < count; i++) {
+        ObjString* text = flattenText(AS_OBJ(texts[i]));
+        memcpy(result->chars + at, text->chars, text->length);
+        at += text->length;
+    }
+    return internString(result);
+}
+
+// Adds count operands left to right, as a chain of OP_ADDs would: numbers
+// sum and texts concatenate, without building the intermediate strings.
+// The operands must be on the stack, which is also used as scratch space.
+// Reports a runtime error and returns false when they are neither all
+// numbers nor all texts, or the text would be too long.
+bool addMany(Value* operands, int count, Value* result) {
+    if(IS_NUMBER(operands[0])) {
+        double sum = AS_NUMBER(operands[0]);
+        for(int i = 1; i < count; i++) {
+            if(!IS_NUMBER(operands[i])) {
+                runtimeError("Operands must be two numbers or two strings");
+                return false;
+            }
+            sum += AS_NUMBER(operands[i]);
+        }
+        *result = NUMBER_VAL(sum);
+        return true;
+    }
+
+    int length = 0;
+    for(int i = 0; i < count; i++) {
+        if(!IS_TEXT(operands[i])) {
+            runtimeError("Operands must be two numbers or two strings");
+            return false;
+        }
+        if(!addLength(&length, textLength(AS_OBJ(operands[i])))) return false;
+    }
+    if(length < ROPE_MIN_LENGTH) {
+        *result = OBJ_VAL(joinTexts(operands, count, length));
+        return true;
+    }
+
+    // Usually a long string being appended to: keep the head as it is and
+    // join a short tail into one piece.
+    int tail = length - textLength(AS_OBJ(operands[0]));
+    if(tail < ROPE_MIN_LENGTH) {
+        operands[1] = OBJ_VAL(joinTexts(operands + 1, count - 1, tail));
+        *result = OBJ_VAL(newRope(AS_OBJ(operands[0]), AS_OBJ(operands[1]), length));
+        return true;
+    }
+
+    // The total fits, so no partial sum can overflow.
+    for(int i = 1; i < count; i++) {
+        concatenate(operands[i - 1], operands[i], &operands[i]);
+    }
+    *result = operands[count - 1];
+    return true;
+}
+
+bool callValue(Value callee, Value* args, int argCount, Value* result) {
+    if(!IS_NATIVE(callee)) {
+        runtimeError("Can only call functions");
+        return false;
+    }
+    ObjNative* native = AS_NATIVE(callee);
+    if(argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d", native->arity, argCount);
+        return false;
+    }
+    return native->function(args, result);
+}
+
+static inline VM* runningVM() {
+    return vm;
 }
 
 static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_LONG_CONSTANT() (vm.chunk->constants.values[(READ_BYTE()<<24) + (READ_BYTE()<<16) + (READ_BYTE()<<8) + (READ_BYTE())])
+    // The isolate cannot change while it runs, so a local copy of the
+    // thread-local pointer saves reloading it in every handler.
+    VM* const vm = runningVM();
+    // ip and sp live in locals so the compiler can keep them in registers;
+    // they are written back to vm only where something outside run() looks at them.
+    register uint8_t* ip = vm->ip;
+    register Value* sp = vm->sp;
+    // No slots are added while a chunk runs, so the array cannot move.
+    Value* globals = vm->globalValues.values;
+    // Code executed in place from a bytecode image is never quickened.
+    bool quicken = !vm->chunk->readOnly;
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_LONG_CONSTANT() \
+    (ip += 3, vm->chunk->constants.values[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_FOR_BOUND() \
+    (READ_BYTE() == FOR_BOUND_LOCAL ? vm->stack[READ_BYTE()] : READ_CONSTANT())
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define SYNC() (vm->ip = ip, vm->sp = sp)
+#define RUNTIME_ERROR(...) do { \
+    SYNC(); \
+    runtimeError(__VA_ARGS__); \
+    return INTERPRET_RUNTIME_ERROR; \
+} while(0)
 #define BINARY_OP(valueType, op) do { \
-    if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers"); \
-        return INTERPRET_RUNTIME_ERROR; \
+    if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers"); \
     } \
-    vm.sp[-2] = NUMBER_VAL(AS_NUMBER(vm.sp[-2]) op AS_NUMBER(vm.sp[-1])); \
-    vm.sp--; \
-} while(0);
-#define READ_STRING() AS_STRING(READ_CONSTANT());
-#define READ_SHORT() \
-    (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+    sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \
+    sp--; \
+} while(0)
+
+// Quickening: a generic handler that just ran rewrites its own opcode to
+// the specialized form for the operand types it saw. The specialized
+// handler only checks its guard; when that fails it puts the generic
+// opcode back and runs the instruction again through it. Images never
+// contain specialized opcodes, so only SPECIALIZE has to check quicken.
+#define SPECIALIZE(opcode) (quicken ? (void)(ip[-1] = (opcode)) : (void)0)
+#define DEOPTIMIZE(opcode) do { \
+    ip[-1] = (opcode); \
+    ip--; \
+    DISPATCH(); \
+} while(0)
+#define NUMBER_OP(valueType, op, generic) do { \
+    if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) DEOPTIMIZE(generic); \
+    sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \
+    sp--; \
+} while(0)
+
+// Back-edges are the safepoints where young objects may move.
+#define SAFEPOINT() do { \
+    if(vm->nurseryFull) { \
+        SYNC(); \
+        collectYoung(); \
+    } \
+} while(0)
+
+// A taken back-edge, with ip at the loop header: lets the tracing JIT
+// count it, start recording, or run the loop's trace.
+#ifdef JIT
+#define LOOP_EDGE() do { \
+    if(traceJitEnabled) { \
+        SYNC(); \
+        TraceAction action = jitLoopEdge(ip, sp); \
+        if(action == TRACE_RECORD) START_RECORDING(); \
+        if(action == TRACE_ERROR) return INTERPRET_RUNTIME_ERROR; \
+        if(action == TRACE_EXITED) { \
+            ip = vm->ip; \
+            sp = vm->sp; \
+        } \
+    } \
+} while(0)
+#else
+#define LOOP_EDGE() do { } while(0)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() do { \
+    printf("          "); \
+    for (Value* slot = vm->stack; slot < sp; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+    } \
+    printf("\n"); \
+    disassembleInstruction(vm->chunk, (int)(ip - vm->chunk->code)); \
+} while(0)
+#elif defined(DEBUG_COUNT_PAIRS)
+    // A pair is only counted when the second opcode runs right after the first.
+    int previous = -1;
+#define TRACE_INSTRUCTION() do { \
+    if(previous != -1) pairCounts[previous][*ip]++; \
+    previous = *ip; \
+} while(0)
+#else
+#define TRACE_INSTRUCTION() do { } while(0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // One label per opcode; every handler jumps straight to the next one
+    // instead of going back through a shared switch.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT]      = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_NEGATE]        = &&L_OP_NEGATE,
+        [OP_ADD]           = &&L_OP_ADD,
+        [OP_SUBTRACT]      = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY]      = &&L_OP_MULTIPLY,
+        [OP_DIVIDE]        = &&L_OP_DIVIDE,
+        [OP_RETURN]        = &&L_OP_RETURN,
+        [OP_NIL]           = &&L_OP_NIL,
+        [OP_TRUE]          = &&L_OP_TRUE,
+        [OP_FALSE]         = &&L_OP_FALSE,
+        [OP_PRINT]         = &&L_OP_PRINT,
+        [OP_NOT]           = &&L_OP_NOT,
+        [OP_EQUAL]         = &&L_OP_EQUAL,
+        [OP_GREATER]       = &&L_OP_GREATER,
+        [OP_LESS]          = &&L_OP_LESS,
+        [OP_POP]           = &&L_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]    = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]    = &&L_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]     = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL]     = &&L_OP_SET_LOCAL,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_JUMP]          = &&L_OP_JUMP,
+        [OP_LOOP]          = &&L_OP_LOOP,
+        [OP_FOR_NUM_PREP]  = &&L_OP_FOR_NUM_PREP,
+        [OP_FOR_NUM_LOOP]  = &&L_OP_FOR_NUM_LOOP,
+        [OP_CONCAT_N]      = &&L_OP_CONCAT_N,
+        [OP_CALL]          = &&L_OP_CALL,
+        [OP_NOT_EQUAL]     = &&L_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]    = &&L_OP_LESS_EQUAL,
+        [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+        [OP_INC_LOCAL_CONST] = &&L_OP_INC_LOCAL_CONST,
+        [OP_LESS_LOCAL_CONST_JUMP] = &&L_OP_LESS_LOCAL_CONST_JUMP,
+        [OP_GET_LOCAL_GET_LOCAL] = &&L_OP_GET_LOCAL_GET_LOCAL,
+        [OP_ADD_NUM]       = &&L_OP_ADD_NUM,
+        [OP_ADD_STR]       = &&L_OP_ADD_STR,
+        [OP_EQUAL_NUM]     = &&L_OP_EQUAL_NUM,
+        [OP_GREATER_NUM]   = &&L_OP_GREATER_NUM,
+        [OP_LESS_NUM]      = &&L_OP_LESS_NUM,
+    };
+
+    void** dispatch = dispatchTable;
+#ifdef JIT
+    // While the tracing JIT records a loop, every opcode goes through
+    // L_RECORD on its way to its handler.
+    static void* recordTable[UINT8_COUNT] = {[0 ... UINT8_COUNT - 1] = &&L_RECORD};
+#define START_RECORDING() (dispatch = recordTable)
+#endif
+
+#define INTERPRET_LOOP    DISPATCH();
+#define CASE(opcode)      L_##opcode:
+#define DISPATCH()        do { TRACE_INSTRUCTION(); goto *dispatch[READ_BYTE()]; } while(0)
+#else
+#ifdef JIT
+    bool recording = false;
+#define START_RECORDING() (recording = true)
+#define RECORD_INSTRUCTION() do { \
+    if(recording && !jitRecord(ip, sp)) recording = false; \
+} while(0)
+#else
+#define RECORD_INSTRUCTION() do { } while(0)
+#endif
+
+#define INTERPRET_LOOP    loop: TRACE_INSTRUCTION(); RECORD_INSTRUCTION(); switch(READ_BYTE())
+#define CASE(opcode)      case opcode:
+#define DISPATCH()        goto loop
+#endif
+
+    INTERPRET_LOOP {
+#if defined(JIT) && defined(COMPUTED_GOTO)
+        L_RECORD:
+            if(!jitRecord(ip - 1, sp)) dispatch = dispatchTable;
+            goto *dispatchTable[ip[-1]];
+#endif
+
+        CASE(OP_ADD) {
+            if(IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {
+                SPECIALIZE(OP_ADD_STR);
+                SYNC();
+                Value result;
+                if(!concatenate(PEEK(1), PEEK(0), &result)) return INTERPRET_RUNTIME_ERROR;
+                sp -= 2;
+                PUSH(result);
+            } else if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                SPECIALIZE(OP_ADD_NUM);
+                BINARY_OP(NUMBER_VAL, +);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        }
 
-    
-    for(;;) {
+        CASE(OP_ADD_NUM)
+            NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+
+        CASE(OP_ADD_STR) {
+            if(!IS_TEXT(PEEK(0)) || !IS_TEXT(PEEK(1))) DEOPTIMIZE(OP_ADD);
+            SYNC();
+            Value result;
+            if(!concatenate(PEEK(1), PEEK(0), &result)) return INTERPRET_RUNTIME_ERROR;
+            sp -= 2;
+            PUSH(result);
+            DISPATCH();
+        }
 
-        #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.sp; slot++) {
-        printf("[ ");
-        printValue(*slot);
-        printf(" ]");
+        CASE(OP_CONCAT_N) {
+            uint8_t count = READ_BYTE();
+            SYNC();
+            Value result;
+            if(!addMany(sp - count, count, &result)) return INTERPRET_RUNTIME_ERROR;
+            sp -= count;
+            PUSH(result);
+            DISPATCH();
         }
-        printf("\n");
-        disassembleInstruction(vm.chunk,(int)(vm.ip - vm.chunk->code));
-        #endif
-
-        uint8_t instruction = READ_BYTE();
-        switch(instruction) {
-            case OP_ADD:
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    Value b = pop();
-                    Value a = pop();
-                    push(concatenate(a, b));
-                    break;
-                } else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    BINARY_OP(NUMBER_VAL, +);
-                    break;
-                } else {
-                    runtimeError("Operands must be two numbers or two strings");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-
-            case OP_NEGATE:
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                vm.sp[-1] = NUMBER_VAL(-AS_NUMBER(vm.sp[-1]));
-                break;
-
-            case OP_CONSTANT_LONG:
-                push(READ_LONG_CONSTANT());
-                break;
-
-            case OP_CONSTANT:
-                push(READ_CONSTANT());
-                break;
-
-            case OP_RETURN:
-                // exit compiler
-                return INTERPRET_OK;
-
-            case OP_NIL: 
-                push(NIL_VAL);
-                break;
-
-            case OP_TRUE:
-                push(BOOL_VAL(1));
-                break;
-
-            case OP_FALSE:
-                push(BOOL_VAL(0));
-                break;
-
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-
-            case OP_EQUAL:
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-
-            case OP_POP:
-                pop();
-                break;
-
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                break;
+
+        CASE(OP_CALL) {
+            uint8_t argCount = READ_BYTE();
+            SYNC();
+            Value result;
+            if(!callValue(PEEK(argCount), sp - argCount, argCount, &result)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            sp -= argCount;
+            sp[-1] = result;
+            DISPATCH();
+        }
+
+        CASE(OP_SUBTRACT)
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+
+        CASE(OP_MULTIPLY)
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+
+        CASE(OP_DIVIDE)
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
 
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if(!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+        CASE(OP_NEGATE)
+            if(!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number");
             }
+            sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+            DISPATCH();
+
+        CASE(OP_CONSTANT_LONG)
+            PUSH(READ_LONG_CONSTANT());
+            DISPATCH();
+
+        CASE(OP_CONSTANT)
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+
+        CASE(OP_RETURN)
+            // exit compiler
+            SYNC();
+            return INTERPRET_OK;
+
+        CASE(OP_NIL)
+            PUSH(NIL_VAL);
+            DISPATCH();
+
+        CASE(OP_TRUE)
+            PUSH(BOOL_VAL(1));
+            DISPATCH();
+
+        CASE(OP_FALSE)
+            PUSH(BOOL_VAL(0));
+            DISPATCH();
+
+        CASE(OP_NOT)
+            sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+            DISPATCH();
+
+        CASE(OP_EQUAL) {
+            if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) SPECIALIZE(OP_EQUAL_NUM);
+            // Comparing a rope flattens it, which can collect.
+            SYNC();
+            bool equal = valuesEqual(PEEK(1), PEEK(0));
+            sp -= 2;
+            PUSH(BOOL_VAL(equal));
+            DISPATCH();
+        }
+
+        CASE(OP_EQUAL_NUM)
+            NUMBER_OP(BOOL_VAL, ==, OP_EQUAL);
+            DISPATCH();
+
+        CASE(OP_NOT_EQUAL) {
+            SYNC();
+            bool equal = valuesEqual(PEEK(1), PEEK(0));
+            sp -= 2;
+            PUSH(BOOL_VAL(!equal));
+            DISPATCH();
+        }
 
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if(tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE(OP_GREATER)
+            BINARY_OP(BOOL_VAL, >);
+            SPECIALIZE(OP_GREATER_NUM);
+            DISPATCH();
+
+        CASE(OP_GREATER_NUM)
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
+
+        // These stand in for OP_LESS/OP_GREATER followed by OP_NOT, so they
+        // negate the comparison rather than flip it; NaN compares the same.
+        CASE(OP_GREATER_EQUAL)
+            BINARY_OP(BOOL_VAL, <);
+            sp[-1] = BOOL_VAL(!AS_BOOL(sp[-1]));
+            DISPATCH();
+
+        CASE(OP_LESS_EQUAL)
+            BINARY_OP(BOOL_VAL, >);
+            sp[-1] = BOOL_VAL(!AS_BOOL(sp[-1]));
+            DISPATCH();
+
+        CASE(OP_LESS)
+            BINARY_OP(BOOL_VAL, <);
+            SPECIALIZE(OP_LESS_NUM);
+            DISPATCH();
+
+        CASE(OP_LESS_NUM)
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+
+        CASE(OP_PRINT)
+            printValue(POP());
+            fputc('\n', vm->out);
+            DISPATCH();
+
+        CASE(OP_POP)
+            sp--;
+            DISPATCH();
+
+        CASE(OP_DEFINE_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            globals[slot] = POP();
+            if(vm->gcMarking) markValue(globals[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            Value value = globals[slot];
+            if(IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'", AS_CSTRING(vm->globalNames.values[slot]));
             }
+            PUSH(value);
+            DISPATCH();
+        }
 
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]);
-                break;
+        CASE(OP_SET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            if(IS_UNDEFINED(globals[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'", AS_CSTRING(vm->globalNames.values[slot]));
             }
+            globals[slot] = PEEK(0);
+            if(vm->gcMarking) markValue(globals[slot]);
+            DISPATCH();
+        }
 
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
-                break;
+        CASE(OP_GET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            PUSH(vm->stack[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            vm->stack[slot] = PEEK(0);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL_POP) {
+            uint8_t slot = READ_BYTE();
+            vm->stack[slot] = POP();
+            DISPATCH();
+        }
+
+        CASE(OP_INC_LOCAL_CONST) {
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            Value local = vm->stack[slot];
+            if(IS_NUMBER(local) && IS_NUMBER(constant)) {
+                vm->stack[slot] = NUMBER_VAL(AS_NUMBER(local) + AS_NUMBER(constant));
+            } else if(IS_TEXT(local) && IS_TEXT(constant)) {
+                SYNC();
+                if(!concatenate(local, constant, &vm->stack[slot])) return INTERPRET_RUNTIME_ERROR;
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings");
             }
+            DISPATCH();
+        }
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) {
-                    vm.ip += offset;
-                } 
-                break;
+        CASE(OP_LESS_LOCAL_CONST_JUMP) {
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            Value local = vm->stack[slot];
+            if(!IS_NUMBER(local) || !IS_NUMBER(constant)) {
+                RUNTIME_ERROR("Operands must be numbers");
+            }
+            if(!(AS_NUMBER(local) < AS_NUMBER(constant))) {
+                ip += offset;
             }
+            DISPATCH();
+        }
+
+        CASE(OP_GET_LOCAL_GET_LOCAL) {
+            uint8_t first = READ_BYTE();
+            uint8_t second = READ_BYTE();
+            PUSH(vm->stack[first]);
+            PUSH(vm->stack[second]);
+            DISPATCH();
+        }
 
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip += offset;
-                break;
+        CASE(OP_JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) {
+                ip += offset;
             }
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP) {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_LOOP) {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            SAFEPOINT();
+            LOOP_EDGE();
+            DISPATCH();
+        }
 
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
-                break;
+        CASE(OP_FOR_NUM_PREP) {
+            uint8_t slot = READ_BYTE();
+            Value bound = READ_FOR_BOUND();
+            uint16_t offset = READ_SHORT();
+            Value counter = vm->stack[slot];
+            if(!IS_NUMBER(counter) || !IS_NUMBER(bound)) {
+                RUNTIME_ERROR("Operands must be numbers");
             }
+            if(!(AS_NUMBER(counter) < AS_NUMBER(bound))) ip += offset;
+            DISPATCH();
+        }
 
+        // The bound is read before the step is added, which only matters
+        // for the degenerate i < i, where both are the same slot.
+        CASE(OP_FOR_NUM_LOOP) {
+            uint8_t slot = READ_BYTE();
+            Value bound = READ_FOR_BOUND();
+            Value step = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            Value counter = vm->stack[slot];
+            if(!IS_NUMBER(counter)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings");
+            }
+            double next = AS_NUMBER(counter) + AS_NUMBER(step);
+            vm->stack[slot] = NUMBER_VAL(next);
+            if(!IS_NUMBER(bound)) {
+                RUNTIME_ERROR("Operands must be numbers");
+            }
+            if(next < AS_NUMBER(bound)) {
+                ip -= offset;
+                SAFEPOINT();
+                LOOP_EDGE();
+            }
+            DISPATCH();
         }
     }
 
-#undef READ_SHORT
-#undef READ_STRING
+    // Only reachable through the switch build on an opcode with no handler.
+    SYNC();
+    runtimeError("Unknown opcode %d", ip[-1]);
+    return INTERPRET_RUNTIME_ERROR;
+
+#undef SAFEPOINT
+#undef LOOP_EDGE
+#undef START_RECORDING
+#undef RECORD_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef TRACE_INSTRUCTION
+#undef NUMBER_OP
+#undef DEOPTIMIZE
+#undef SPECIALIZE
 #undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef SYNC
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef READ_SHORT
+#undef READ_FOR_BOUND
 #undef READ_LONG_CONSTANT
 #undef READ_CONSTANT
 #undef READ_BYTE
 }
 
-InterpretResult interpret(const char* source) {
+// Moves a block out of the closed request region; a heap block stays put.
+#define PROMOTE_ARRAY(type, ptr, count) \
+    (inRegion(ptr) ? GROW_ARRAY(type, ptr, count, count) : (ptr))
+
+static ObjString* promoteString(ObjString* string) {
+    if(!inRegion(string)) return string;
+
+    // Uninterning the region string makes copyString() build a heap copy
+    // the first time; later references to the same characters find it.
+    tableDelete(&vm->strings, string);
+    return copyString(string->chars, string->length);
+}
+
+// Once the region has run out, heap ropes may have been built over
+// region strings, so those are flattened too.
+static Value promoteValue(Value value) {
+    if(!IS_OBJ(value)) return value;
+    if(!inRegion(AS_OBJ(value)) && !(vm->region.exhausted && IS_ROPE(value))) return value;
+    return OBJ_VAL(promoteString(flattenText(AS_OBJ(value))));
+}
+
+// Ends an arena-mode call: everything the globals still reference moves
+// to the heap, and the rest goes with the region.
+static void promoteSurvivors() {
+    closeRegion();
+
+    vm->strings.control = PROMOTE_ARRAY(uint8_t, vm->strings.control, vm->strings.capacity);
+    vm->strings.entries = PROMOTE_ARRAY(Entry, vm->strings.entries, vm->strings.capacity);
+    vm->globalSlots.control = PROMOTE_ARRAY(uint8_t, vm->globalSlots.control, vm->globalSlots.capacity);
+    vm->globalSlots.entries = PROMOTE_ARRAY(Entry, vm->globalSlots.entries, vm->globalSlots.capacity);
+    vm->globalNames.values = PROMOTE_ARRAY(Value, vm->globalNames.values, vm->globalNames.capacity);
+    vm->globalValues.values = PROMOTE_ARRAY(Value, vm->globalValues.values, vm->globalValues.capacity);
+
+    for(uint32_t i = 0; i < vm->globalValues.count; i++) {
+        vm->globalNames.values[i] = promoteValue(vm->globalNames.values[i]);
+        vm->globalValues.values[i] = promoteValue(vm->globalValues.values[i]);
+    }
+    // The promoted name has the same characters and hash, so it can take
+    // the old key's place without rehashing.
+    for(int i = 0; i < vm->globalSlots.capacity; i++) {
+        Entry* entry = &vm->globalSlots.entries[i];
+        if(entry->key != NULL) entry->key = promoteString(entry->key);
+    }
+    for(int i = 0; i < vm->strings.capacity; i++) {
+        ObjString* key = vm->strings.entries[i].key;
+        if(key != NULL && inRegion(key)) tableDelete(&vm->strings, key);
+    }
+
+    resetStack();
+    releaseRegion();
+}
+
+// Builds the chunk to run from input, reporting any error itself.
+typedef bool (*ChunkLoader)(const void* input, size_t size, Chunk* chunk);
+
+static InterpretResult execute(ChunkLoader load, const void* input, size_t size) {
+    if(vm->arenaMode) openRegion();
     Chunk chunk;
     initChunk(&chunk);
 
-    if(!compile(source, &chunk)) {
+    // Constants become roots as soon as the loader adds them.
+    vm->chunk = &chunk;
+    if(!load(input, size, &chunk)) {
+        vm->chunk = NULL;
         freeChunk(&chunk);
+        if(vm->arenaMode) promoteSurvivors();
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    vm->ip = vm->chunk->code;
+
+    // Only running code has safepoints, so the compiler allocates old.
+    enableNursery(true);
+    InterpretResult result;
+    if(!jitEnabled || !jitRun(&chunk, &result)) result = run();
+    enableNursery(false);
+#ifdef JIT
+    jitFreeTraces();
+#endif
+
+    vm->chunk = NULL;
+    freeChunk(&chunk);
+    if(vm->arenaMode) promoteSurvivors();
+    return result;
+}
+static bool compileSource(const void* input, size_t size, Chunk* chunk) {
+    (void)size;
+    return compile((const char*)input, chunk);
+}
+
+InterpretResult interpret(VM* isolate, const char* source) {
+    VM* previous = bindVM(isolate);
+    InterpretResult result = execute(compileSource, source, 0);
+    bindVM(previous);
+    return result;
+}
+
+static bool loadBytecode(const void* input, size_t size, Chunk* chunk) {
+    if(readBytecode((const uint8_t*)input, size, chunk)) return true;
+    fprintf(vm->err, "Invalid or outdated bytecode file.\n");
+    return false;
+}
+
+InterpretResult interpretBytecode(VM* isolate, const uint8_t* bytes, size_t size) {
+    VM* previous = bindVM(isolate);
+    InterpretResult result = execute(loadBytecode, bytes, size);
+    bindVM(previous);
+    return result;
+}
 
-    InterpretResult result = run();
+// Compiled on a VM of its own, so the program's global slots are numbered
+// from zero and its strings belong to no VM that outlives the call.
+Program* potatoCompile(const char* source) {
+    VM* compiler = potatoNewVM();
+    if(vm != NULL) compiler->err = vm->err;
+    VM* previous = bindVM(compiler);
 
+    Chunk chunk;
+    initChunk(&chunk);
+    vm->chunk = &chunk;
+    Program* program = compile(source, &chunk) ? freezeProgram(&chunk) : NULL;
+    vm->chunk = NULL;
     freeChunk(&chunk);
+
+    bindVM(previous);
+    potatoFreeVM(compiler);
+    return program;
+}
+
+static bool loadProgram(const void* input, size_t size, Chunk* chunk) {
+    (void)size;
+    thawProgram((const Program*)input, chunk);
+    return true;
+}
+
+InterpretResult potatoRun(VM* isolate, const Program* program) {
+    VM* previous = bindVM(isolate);
+    InterpretResult result = execute(loadProgram, program, 0);
+    bindVM(previous);
     return result;
-}
\ No newline at end of file
+}
+
+Channel* potatoNewChannel(int capacity) {
+    return newChannel(capacity);
+}
+
+void potatoReleaseChannel(Channel* channel) {
+    releaseChannel(channel);
+}
+
+void potatoDefineChannel(VM* isolate, const char* name, Channel* channel) {
+    VM* previous = bindVM(isolate);
+    retainChannel(channel);
+    defineGlobal(name, OBJ_VAL(newChannelHandle(channel)));
+    bindVM(previous);
+}
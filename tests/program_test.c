@@ -0,0 +1,124 @@
+// Compiles one script with potatoCompile() and runs the Program on two
+// VMs, one of which already has globals, and then on two threads at once.
+// Every run must print what interpret() prints for the same source.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+static const char* source =
+    "var greeting = \"hello\";\n"
+    "var total = 0;\n"
+    "for (var i = 1; i <= 100; i = i + 1) total = total + i;\n"
+    "print greeting + \" \" + \"world\";\n"
+    "print total;\n"
+    "var long = \"\";\n"
+    "for (var i = 0; i < 50; i = i + 1) long = long + greeting;\n"
+    "print long == long + \"\";\n";
+
+// Globals the second VM defines first, so the Program's slots and
+// strings have to be mapped onto the ones it already has.
+static const char* prelude =
+    "var unrelated = 1;\n"
+    "var total = \"shadowed\";\n"
+    "var greeting = \"hello\";\n";
+
+typedef struct {
+    const Program* program;
+    const char* expected;
+    bool failed;
+} Job;
+
+// Runs program on isolate and compares what it prints with expected.
+static bool runMatches(VM* isolate, const Program* program, const char* expected) {
+    char* output;
+    size_t size;
+    isolate->out = open_memstream(&output, &size);
+    isolate->err = isolate->out;
+    InterpretResult result = potatoRun(isolate, program);
+    fclose(isolate->out);
+    isolate->out = stdout;
+    isolate->err = stderr;
+
+    bool matches = result == INTERPRET_OK && strcmp(output, expected) == 0;
+    if(!matches) fprintf(stderr, "got:\n%s", output);
+    free(output);
+    return matches;
+}
+
+static void* runJob(void* argument) {
+    Job* job = argument;
+    VM* isolate = potatoNewVM();
+    for(int i = 0; i < 20 && !job->failed; i++) {
+        if(!runMatches(isolate, job->program, job->expected)) job->failed = true;
+        potatoResetVM(isolate);
+    }
+    potatoFreeVM(isolate);
+    return NULL;
+}
+
+static char* interpretOutput(const char* text) {
+    char* output;
+    size_t size;
+    VM* isolate = potatoNewVM();
+    isolate->out = open_memstream(&output, &size);
+    isolate->err = isolate->out;
+    if(interpret(isolate, text) != INTERPRET_OK) {
+        fprintf(stderr, "program_test: reference run failed\n");
+        exit(1);
+    }
+    fclose(isolate->out);
+    isolate->out = stdout;
+    isolate->err = stderr;
+    potatoFreeVM(isolate);
+    return output;
+}
+
+int main() {
+    char* expected = interpretOutput(source);
+    Program* program = potatoCompile(source);
+    if(program == NULL) {
+        fprintf(stderr, "program_test: compile failed\n");
+        return 1;
+    }
+    int failures = 0;
+
+    VM* fresh = potatoNewVM();
+    if(!runMatches(fresh, program, expected)) {
+        fprintf(stderr, "program_test: fresh VM differs\n");
+        failures++;
+    }
+
+    VM* defined = potatoNewVM();
+    defined->out = fopen("/dev/null", "w");
+    interpret(defined, prelude);
+    fclose(defined->out);
+    defined->out = stdout;
+    if(!runMatches(defined, program, expected)) {
+        fprintf(stderr, "program_test: VM with globals differs\n");
+        failures++;
+    }
+    potatoFreeVM(fresh);
+    potatoFreeVM(defined);
+
+    Job jobs[2];
+    pthread_t threads[2];
+    for(int i = 0; i < 2; i++) {
+        jobs[i] = (Job){program, expected, false};
+        pthread_create(&threads[i], NULL, runJob, &jobs[i]);
+    }
+    for(int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        if(jobs[i].failed) {
+            fprintf(stderr, "program_test: thread %d differs\n", i);
+            failures++;
+        }
+    }
+
+    potatoFreeProgram(program);
+    free(expected);
+    return failures == 0 ? 0 : 1;
+}
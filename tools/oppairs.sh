@@ -0,0 +1,29 @@
+#!/bin/sh
+# Counts how often each pair of opcodes executes back to back over a
+# corpus of scripts, most frequent first.
+#
+#   tools/oppairs.sh [-n top] script.pot...
+
+top=30
+if [ "$1" = "-n" ]; then
+    top=$2
+    shift 2
+fi
+
+if [ $# -eq 0 ]; then
+    echo "Usage: tools/oppairs.sh [-n top] script.pot..." >&2
+    exit 64
+fi
+
+cd "$(dirname "$0")/.." || exit 1
+make -s potato-pairs || exit 1
+cd - >/dev/null || exit 1
+
+potato="$(dirname "$0")/../potato-pairs"
+for script in "$@"; do
+    "$potato" "$script" 2>&1 >/dev/null
+done | awk '
+    $1 == "pair" { count[$2 " " $3] += $4; total += $4 }
+    END {
+        for (pair in count) printf "%12d %6.2f%%  %s\n", count[pair], 100 * count[pair] / total, pair
+    }' | sort -rn | head -n "$top"
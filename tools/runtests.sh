@@ -0,0 +1,48 @@
+#!/bin/sh
+# Runs every tests/*.pot and compares its output, stderr included, and
+# exit status with tests/name.expected. Options for the interpreter go in
+# tests/name.args. Then runs every test program make built, which exits
+# nonzero on failure.
+#
+#   tools/runtests.sh [-u]
+#
+# -u rewrites the .expected files from the current output instead.
+
+cd "$(dirname "$0")/.." || exit 1
+
+update=0
+if [ "$1" = "-u" ]; then
+    update=1
+fi
+
+failed=0
+for script in tests/*.pot; do
+    name="${script%.pot}"
+    args=""
+    if [ -f "$name.args" ]; then
+        args=$(cat "$name.args")
+    fi
+    # shellcheck disable=SC2086
+    actual=$(./potato $args "$script" 2>&1; echo "exit $?")
+    if [ $update -eq 1 ]; then
+        printf '%s\n' "$actual" > "$name.expected"
+    elif [ "$actual" != "$(cat "$name.expected" 2>/dev/null)" ]; then
+        echo "FAIL $script"
+        printf '%s\n' "$actual" | diff "$name.expected" - | head -n 20
+        failed=$((failed + 1))
+    fi
+done
+
+for program in tests/*_test; do
+    [ -x "$program" ] || continue
+    if ! "$program"; then
+        echo "FAIL $program"
+        failed=$((failed + 1))
+    fi
+done
+
+if [ $failed -ne 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "all passed"